@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+# Part of lscov, requires Python 3.8+.
+# What measuring logic state coverage costs: libxml2's fuzz harnesses, built plain, with AFL++'s instrumentation, with
+# lscov's, and with both, each run over its seed corpus for a fixed number of executions (see driver.c).
+import argparse, json, multiprocessing, os, platform, shutil, statistics, subprocess, sys
+from dataclasses import asdict, dataclass
+from pathlib import Path
+from typing import Dict, List, Optional
+
+blue   = lambda text: f"\033[1;94m{text}\033[0m"; gray = lambda text: f"\033[1;90m{text}\033[0m"
+green  = lambda text: f"\033[0;32m{text}\033[0m"; red  = lambda text: f"\033[0;31m{text}\033[0m"
+yellow = lambda text: f"\033[0;33m{text}\033[0m"
+
+bench_dir = Path(__file__).resolve().parent
+lscov_dir = bench_dir.parent
+repo_dir = lscov_dir.parent
+libxml2_dir = repo_dir / "testbed" / "libxml2"
+aflpp_dir = repo_dir / "testbed" / "aflpp"
+
+@dataclass
+class Variant:
+    name: str
+    cc: List[str]
+    env: Dict[str, str]
+    daemon: bool          # Run under lscov-daemon (measured)
+
+@dataclass
+class Run:
+    execs_per_sec: float
+    overhead_pct: Optional[float]    # Against plain
+    p50_us: float
+    p90_us: float
+    p99_us: float
+    target_cpu_sec: float
+    daemon_cpu_sec: Optional[float]
+    logic_states: Optional[int]
+
+@dataclass
+class Config:
+    cc: str
+    cflags: str
+    commit: str
+    comment: str
+    execs: int
+    runs: int
+
+@dataclass
+class Hardware:
+    cpu_model: str
+    cpu_threads: int
+    kernel: str
+
+@dataclass
+class Results:
+    config: Config
+    hardware: Hardware
+    targets: Dict[str, Dict[str, Optional[Run]]]
+
+all_harnesses = ["xml", "html", "xpath", "regexp", "schema", "uri", "valid", "xinclude"]
+all_variants = ["plain", "aflpp", "lscov", "combined"]
+
+# Seed corpora, as in fuzz/Makefile.am (uri and regexp: see make_static_seeds()).
+xml_seed_src = ["test/*", "test/errors/*.xml", "test/errors10/*.xml", "test/namespaces/*", "test/recurse/*.xml",
+                "test/SVG/*.xml", "test/valid/*.xml", "test/VC/*", "test/VCM/*", "test/xmlid/*"]
+seed_src = {
+    "xml": xml_seed_src, "valid": xml_seed_src, "html": ["test/HTML/*"], "schema": ["test/schemas/*.xsd"],
+    "xpath": ["test/XPath"], "xinclude": ["test/XInclude/docs/*", "test/XInclude/without-reader/*"],
+}
+
+parser = argparse.ArgumentParser(formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument("-b", "--basedir", help="directory to build and run in", type=str, default="/tmp/lscov-benchmark")
+parser.add_argument("-n", "--execs", help="executions per run", type=int, default=100000)
+parser.add_argument("-r", "--runs", help="how many runs to take the median of", type=int, default=3)
+parser.add_argument("-t", "--target", help="pick harnesses", action="append", choices=all_harnesses)
+parser.add_argument("-V", "--variant", help="pick variants", action="append", choices=all_variants)
+parser.add_argument("-c", "--comment", help="add a comment about your setup", type=str, default="")
+parser.add_argument("-o", "--out", help="results to append to", type=str,
+                    default=str(bench_dir / "benchmark-results.jsonl"))
+parser.add_argument("--cc", help="compiler of the plain variant (lscov-clang's must be the same)", type=str,
+                    default="clang")
+parser.add_argument("--cflags", help="flags for libxml2 and the harnesses", type=str, default="-O2 -g")
+parser.add_argument("--lscov-build", help="lscov's build directory", type=str, default=str(lscov_dir / "build"))
+parser.add_argument("--daemon-args", help="more lscov-daemon arguments", type=str, default="")
+parser.add_argument("-d", "--debug", help="show build and daemon output", action="store_true")
+args = parser.parse_args()
+args.target = args.target or all_harnesses
+args.variant = args.variant or all_variants
+basedir = Path(args.basedir).resolve()
+lscov_build = Path(args.lscov_build).resolve()
+cpu_count = multiprocessing.cpu_count()
+
+def run(cmd: List[str], cwd: Optional[Path] = None, env: Optional[Dict[str, str]] = None) -> None:
+    if args.debug:
+        print(gray(f"[*] {' '.join(str(c) for c in cmd)}"))
+    out = None if args.debug else subprocess.DEVNULL
+    subprocess.run(cmd, cwd=cwd, env=env, stdout=out, stderr=out, check=True)
+
+def find_tool(name: str, *dirs: Path) -> Optional[str]:
+    for d in dirs:
+        if (d / name).is_file() and os.access(d / name, os.X_OK):
+            return str(d / name)
+    return shutil.which(name)
+
+def get_variants() -> List[Variant]:
+    """The variants asked for whose compilers are around."""
+    lscov_clang = find_tool("lscov-clang", lscov_build)
+    afl_cc = find_tool("afl-clang-fast", aflpp_dir)
+    daemon = find_tool("lscov-daemon", lscov_build)
+    candidates = {
+        "plain": (Variant("plain", [args.cc], {}, False), shutil.which(args.cc)),
+        "aflpp": (Variant("aflpp", [str(afl_cc)], {"AFL_QUIET": "1"}, False), afl_cc),
+        "lscov": (Variant("lscov", [str(lscov_clang)], {}, True), lscov_clang and daemon),
+        "combined": (Variant("combined", [str(afl_cc)],
+                             {"AFL_QUIET": "1", "AFL_LLVM_LSCOV": "1", "AFL_LSCOV_PATH": str(lscov_build)}, True),
+                     afl_cc and lscov_clang and daemon),
+    }
+    # lscov-clang compiles with whatever its build's wrap-clang links to, so the overhead is only lscov's if that's
+    # the plain variant's compiler.
+    cc = shutil.which(args.cc)
+    wrap_clang = lscov_build / "wrap-clang"
+    wrapped = str(wrap_clang.resolve()) if wrap_clang.is_symlink() else None
+    variants = []
+    for name in args.variant:
+        variant, available = candidates[name]
+        if available and name == "lscov" and (not cc or wrapped != str(Path(cc).resolve())):
+            print(yellow(f"[!] Skipping the lscov variant: lscov-clang wraps {wrapped}, not {args.cc} "
+                         f"(rebuild lscov with WRAP_CC={args.cc})."))
+        elif available:
+            variants.append(variant)
+        else:
+            print(yellow(f"[!] Skipping the {name} variant: its compiler (or lscov-daemon) wasn't found."))
+    return variants
+
+def build(variant: Variant) -> Path:
+    """libxml2 (static, without the optional dependencies), the driver, and every harness asked for."""
+    out = basedir / variant.name
+    lib_build = out / "libxml2"
+    env = {**os.environ, **variant.env, "CC": " ".join(variant.cc)}
+    cflags = f"{args.cflags} -DFUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION"
+    print(blue(f"[*] Building libxml2 ({variant.name})..."))
+    run(["cmake", "-S", str(libxml2_dir), "-B", str(lib_build), "-DBUILD_SHARED_LIBS=OFF",
+         "-DCMAKE_BUILD_TYPE=None", f"-DCMAKE_C_FLAGS={cflags}"] +
+        [f"-DLIBXML2_WITH_{opt}=OFF" for opt in ["HTTP", "LZMA", "MODULES", "PROGRAMS", "PYTHON", "TESTS", "ZLIB"]],
+        env=env)
+    run(["cmake", "--build", str(lib_build), "--target", "LibXml2", f"-j{cpu_count}"], env=env)
+    lib = lib_build / "libxml2.a"
+
+    includes = ["-I", str(libxml2_dir / "include"), "-I", str(lib_build), "-I", str(lscov_dir)]
+    for harness in args.target + (["genSeed"] if variant.name == "plain" else []):
+        print(gray(f"[*] Building {harness} ({variant.name})..."))
+        sources = [str(libxml2_dir / "fuzz" / f"{harness}.c"), str(libxml2_dir / "fuzz" / "fuzz.c")]
+        if harness != "genSeed":
+            sources.append(str(bench_dir / "driver.c"))
+        run(variant.cc + cflags.split() + includes + sources +
+            ["-o", str(out / harness), str(lib), "-lm", "-lpthread", "-ldl"], env=env)
+    return out
+
+def make_static_seeds(harness: str, seed: Path) -> None:
+    """Seeds for the harnesses without genSeed support: a 4-byte allocation limit (none), then the strings, each
+    escaped and terminated the way xmlFuzzReadString() expects."""
+    def entry(*strings: str) -> bytes:
+        data = b"\0\0\0\0"
+        for s in strings:
+            data += s.encode().replace(b"\\", b"\\\\") + b"\\\n"
+        return data
+
+    entries = []
+    if harness == "regexp":
+        for path in sorted((libxml2_dir / "test" / "regexp").iterdir()):
+            for line in path.read_text(errors="replace").splitlines():
+                if line.startswith("=>"):
+                    entries.append(entry(line[2:]))
+    else:
+        for path in sorted((libxml2_dir / "test" / "URI").glob("*.data")) + \
+                    sorted((libxml2_dir / "test" / "URI").glob("*.uri")):
+            for line in path.read_text(errors="replace").splitlines():
+                entries.append(entry(line, "http://foo.com/path/to/index.html?orig#help"))
+    for i, data in enumerate(entries):
+        (seed / f"{i:04d}").write_bytes(data)
+
+def make_seeds(harness: str, gen_seed: Path) -> Path:
+    seed = basedir / "seed" / harness
+    if seed.is_dir() and any(seed.iterdir()):
+        return seed
+    seed.mkdir(parents=True, exist_ok=True)
+    print(gray(f"[*] Generating the {harness} seed corpus..."))
+    if harness in seed_src:
+        run([str(gen_seed), harness] + [str(libxml2_dir / src) for src in seed_src[harness]], cwd=basedir)
+    else:
+        make_static_seeds(harness, seed)
+    return seed
+
+def last_row(csv_path: Path) -> Dict[str, str]:
+    try:
+        lines = csv_path.read_text().splitlines()
+        return dict(zip(lines[0].split(","), lines[-1].split(","))) if len(lines) > 1 else {}
+    except OSError:
+        return {}
+
+def run_once(variant: Variant, binary: Path, seed: Path) -> Run:
+    out = basedir / variant.name / "runs"
+    out.mkdir(exist_ok=True)
+    report = out / f"{binary.name}.json"
+    csv_path = out / f"{binary.name}.csv"
+    report.unlink(missing_ok=True)
+    cmd = [str(binary), str(args.execs), str(report), str(seed)]
+    if variant.daemon:
+        cmd = [find_tool("lscov-daemon", lscov_build), "-L", "-o", str(csv_path)] + args.daemon_args.split() + \
+              ["--"] + cmd
+    env = {k: v for k, v in os.environ.items() if k != "LSCOV_CHANNEL"}
+    devnull = None if args.debug else subprocess.DEVNULL
+    proc = subprocess.Popen(cmd, env=env, stdout=devnull, stderr=devnull)
+    _, status, rusage = os.wait4(proc.pid, 0)
+    if status != 0 or not report.is_file():
+        raise RuntimeError(f"'{' '.join(cmd)}' failed (status {status})")
+
+    stats = json.loads(report.read_text())
+    if variant.daemon and not stats["lscov"]:
+        raise RuntimeError(f"{binary} ran unmeasured; is it linked with the lscov runtime?")
+    # wait4() counts the daemon and the target it waited for, so the daemon's own share is what's left.
+    total_cpu = rusage.ru_utime + rusage.ru_stime
+    row = last_row(csv_path) if variant.daemon else {}
+    return Run(execs_per_sec=stats["execs_per_sec"], overhead_pct=None, p50_us=stats["p50_us"],
+               p90_us=stats["p90_us"], p99_us=stats["p99_us"], target_cpu_sec=stats["cpu_seconds"],
+               daemon_cpu_sec=round(total_cpu - stats["cpu_seconds"], 6) if variant.daemon else None,
+               logic_states=int(float(row["Coverage"])) if row.get("Coverage") else None)
+
+def median_run(runs: List[Run]) -> Run:
+    med = lambda key: statistics.median(getattr(r, key) for r in runs)
+    daemon_cpu = [r.daemon_cpu_sec for r in runs if r.daemon_cpu_sec is not None]
+    return Run(execs_per_sec=round(med("execs_per_sec"), 1), overhead_pct=None, p50_us=round(med("p50_us"), 3),
+               p90_us=round(med("p90_us"), 3), p99_us=round(med("p99_us"), 3),
+               target_cpu_sec=round(med("target_cpu_sec"), 6),
+               daemon_cpu_sec=round(statistics.median(daemon_cpu), 6) if daemon_cpu else None,
+               logic_states=runs[-1].logic_states)
+
+def cpu_model() -> str:
+    try:
+        for line in Path("/proc/cpuinfo").read_text().splitlines():
+            if line.startswith("model name"):
+                return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return platform.processor()
+
+def commit() -> str:
+    try:
+        return subprocess.run(["git", "-C", str(repo_dir), "rev-parse", "--short", "HEAD"], capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+def main() -> None:
+    variants = get_variants()
+    if not variants:
+        sys.exit(red("[!] Nothing to benchmark."))
+    basedir.mkdir(parents=True, exist_ok=True)
+
+    # Seeds come from the plain build's genSeed (or the first variant's, if plain isn't asked for).
+    builds = {v.name: build(v) for v in variants}
+    seed_builder = builds.get("plain")
+    if seed_builder is None:
+        seed_builder = basedir / "plain"
+        build(Variant("plain", [args.cc], {}, False))
+
+    results = Results(config=Config(cc=args.cc, cflags=args.cflags, commit=commit(), comment=args.comment,
+                                    execs=args.execs, runs=args.runs),
+                      hardware=Hardware(cpu_model=cpu_model(), cpu_threads=cpu_count, kernel=platform.release()),
+                      targets={})
+    for harness in args.target:
+        seed = make_seeds(harness, seed_builder / "genSeed")
+        results.targets[harness] = {}
+        for variant in variants:
+            print(blue(f"[*] Running {harness} ({variant.name}), {args.runs} x {args.execs} executions..."))
+            try:
+                runs = [run_once(variant, builds[variant.name] / harness, seed) for _ in range(args.runs)]
+                results.targets[harness][variant.name] = median_run(runs)
+            except (RuntimeError, OSError) as e:
+                print(red(f"[!] {e}"))
+                results.targets[harness][variant.name] = None
+
+        plain = results.targets[harness].get("plain")
+        for result in results.targets[harness].values():
+            if plain and result:
+                result.overhead_pct = round((plain.execs_per_sec / result.execs_per_sec - 1) * 100, 2)
+
+    # Append a single row in JSON Lines format (simple to write and diff), like AFL++'s benchmark.
+    with open(args.out, "a") as jsonfile:
+        json.dump(asdict(results), jsonfile, sort_keys=True)
+        jsonfile.write("\n")
+
+    print(blue(f"\n{'harness':<10} {'variant':<10} {'execs/s':>10} {'overhead':>9} {'p50 us':>9} {'p99 us':>9} "
+               f"{'daemon cpu':>11}"))
+    for harness, runs in results.targets.items():
+        for name, r in runs.items():
+            if r is None:
+                print(f"{harness:<10} {name:<10} {red('failed'):>10}")
+                continue
+            overhead = f"{r.overhead_pct:+.1f}%" if r.overhead_pct is not None else "-"
+            daemon_cpu = f"{r.daemon_cpu_sec:.2f}s" if r.daemon_cpu_sec is not None else "-"
+            print(f"{harness:<10} {name:<10} {r.execs_per_sec:>10.1f} {overhead:>9} {r.p50_us:>9.2f} "
+                  f"{r.p99_us:>9.2f} {daemon_cpu:>11}")
+    print(green(f"\n[*] Results appended to {args.out}."))
+
+if __name__ == "__main__":
+    main()
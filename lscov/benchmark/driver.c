@@ -0,0 +1,145 @@
+/*
+ * lscov - benchmark driver
+ * ------------------------
+ *
+ * Run a libFuzzer harness over a corpus, round robin, a fixed number of
+ * times. Each run is an execution of its own as far as lscov is concerned,
+ * the way a persistent-mode fuzzer would hand them over, so the daemon sees
+ * every one of them without a fork in between. Writes what it took (per
+ * execution, and in total) to a JSON file.
+ *
+ * Built with the same compiler as the harness, whichever it is; without the
+ * lscov runtime (or a daemon), it just runs the harness.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "stuff.h"
+#include "hist.h"
+
+int LLVMFuzzerTestOneInput(const u8* data, size_t size);
+int LLVMFuzzerInitialize(int* argc, char*** argv) __attribute__((weak));
+
+/* From the lscov runtime, if linked in. */
+
+extern void* __lscov_chan __attribute__((weak));
+void __lscov_start_exec(void) __attribute__((weak));
+void __lscov_end_exec(void) __attribute__((weak));
+
+struct input {
+  u8*         data;
+  size_t      size;
+};
+
+static struct input* inputs;
+static u32 num_inputs;
+
+static void load_input(const char* path) {
+  FILE* f = fopen(path, "rb");
+  struct stat st;
+  if (!f || fstat(fileno(f), &st) || !S_ISREG(st.st_mode)) {
+    if (f)
+      fclose(f);
+    return;
+  }
+
+  inputs = realloc(inputs, (num_inputs + 1) * sizeof(struct input));
+  struct input* in = &inputs[num_inputs];
+  in->size = st.st_size;
+  in->data = malloc(in->size + 1);
+  if (!inputs || !in->data || fread(in->data, 1, in->size, f) != in->size)
+    PFATAL("cannot read '%s'", path);
+
+  num_inputs++;
+  fclose(f);
+}
+
+static void load_inputs(const char* path) {
+  /* A file, or a directory of them (sorted, for the same order every time). */
+  struct dirent** entries;
+  int n = scandir(path, &entries, NULL, alphasort);
+  if (n < 0) {
+    load_input(path);
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (entries[i]->d_name[0] != '.') {
+      char* file;
+      if (asprintf(&file, "%s/%s", path, entries[i]->d_name) < 0)
+        PFATAL("asprintf() failed.");
+      load_input(file);
+      free(file);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    SAYF("Usage: %s <execs> <JSON out> <corpus>...\n", argv[0]);
+    exit(1);
+  }
+
+  u64 num_execs = strtoull(argv[1], NULL, 0);
+  const char* out_path = argv[2];
+
+  for (int i = 3; i < argc; i++)
+    load_inputs(argv[i]);
+  if (!num_execs || !num_inputs)
+    FATAL("nothing to run (%lu execution(s), %u input(s))", num_execs,
+        num_inputs);
+
+  if (LLVMFuzzerInitialize)
+    LLVMFuzzerInitialize(&argc, &argv);
+
+  /* The runtime started the first execution already (at main()), and will
+   * end the last one (at exit). In between, hand them over one by one. */
+  u8 lscov = &__lscov_chan && __lscov_chan && __lscov_start_exec;
+  static struct lscov_hist hist, none;
+  u64 start_ns = lscov_now_ns();
+
+  for (u64 i = 0; i < num_execs; i++) {
+    struct input* in = &inputs[i % num_inputs];
+    u64 exec_start_ns = lscov_now_ns();
+
+    if (lscov && i) {
+      __lscov_end_exec();
+      __lscov_start_exec();
+    }
+    LLVMFuzzerTestOneInput(in->data, in->size);
+
+    lscov_hist_add(&hist, lscov_now_ns() - exec_start_ns);
+  }
+
+  double seconds = (lscov_now_ns() - start_ns) / 1e9;
+  static const double q[3] = { 0.5, 0.9, 0.99 };
+  double lat[3];
+  lscov_hist_quantiles(&hist, &none, q, lat, 3);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+  FILE* out = fopen(out_path, "w");
+  if (!out)
+    PFATAL("cannot open '%s'", out_path);
+  fprintf(out, "{\"execs\": %lu, \"inputs\": %u, \"seconds\": %.6f, "
+      "\"execs_per_sec\": %.1f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+      "\"p99_us\": %.3f, \"cpu_seconds\": %.6f, \"lscov\": %s}\n",
+      num_execs, num_inputs, seconds, num_execs / seconds, lat[0] / 1000,
+      lat[1] / 1000, lat[2] / 1000, cpu, lscov ? "true" : "false");
+  fclose(out);
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * lscov - bucketing
+ * -----------------
+ *
+ * Hit counts to logic states. A bucketing scheme is a staircase: each step
+ * says "from this many hits on, record this value". Applying one is a handful
+ * of byte compares and blends per 16 or 32 bytes, so there are SIMD kernels
+ * (picked at runtime by what the CPU supports) besides the scalar table
+ * lookup. All-zero blocks, the vast majority, are skipped.
+ */
+
+#pragma once
+
+#include "stuff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define LSCOV_BUCKET_X86
+#endif
+
+#define BUCKET_STEPS_MAX 15
+
+struct lscov_bucket {
+  const char* name;
+  const char* desc;
+  u8          num_steps;                  // 0: keep raw hit counts
+  u8          lo[BUCKET_STEPS_MAX];       // Step starts (ascending, > 0)
+  u8          val[BUCKET_STEPS_MAX];      // Values from there on
+  u8          lut[256];                   // Filled in by lscov_bucket_init()
+};
+
+/* Excerpted from AFL, and from what we've tried since. The first one is the
+ * default, giving the same logic states as not counting hits at all. */
+
+static struct lscov_bucket lscov_buckets[] = {
+  { "1", "hit or not",
+    1, { 1 }, { 1 } },
+  { "log2_log3p2", "no hit, 1-8 (hit), 9+ (repetition)",
+    2, { 1, 9 }, { 1, 2 } },
+  { "log2_log4p1_p1", "no hit, 1-3 (hit), 4-63 (revisit), 64+ (repetition)",
+    3, { 1, 4, 64 }, { 1, 2, 4 } },
+  { "log2", "AFL's: 1, 2-3, 4-7, ..., 128+",
+    8, { 1, 2, 4, 8, 16, 32, 64, 128 }, { 1, 2, 4, 8, 16, 32, 64, 128 } },
+  { "none", "raw hit counts",
+    0, { 0 }, { 0 } },
+};
+
+#define NUM_BUCKETS (sizeof(lscov_buckets) / sizeof(struct lscov_bucket))
+
+typedef void (*lscov_bucket_fn)(const struct lscov_bucket*, u8*, const u8*,
+    u32);
+
+static inline struct lscov_bucket* lscov_bucket_find(const char* name) {
+  for (u32 i = 0; i < NUM_BUCKETS; i++)
+    if (!strcmp(lscov_buckets[i].name, name))
+      return &lscov_buckets[i];
+
+  return NULL;
+}
+
+static inline void lscov_bucket_init(struct lscov_bucket* b) {
+  u8 val = 0;
+  u8 step = 0;
+
+  for (u32 hc = 0; hc < 256; hc++) {
+    if (b->num_steps && step < b->num_steps && hc == b->lo[step])
+      val = b->val[step++];
+    b->lut[hc] = b->num_steps ? val : hc;
+  }
+}
+
+/* Scalar: a table lookup per byte, a word at a time for the zero check. 'len'
+ * is a multiple of LSTATE_ALIGN for all of these. */
+
+static void lscov_bucket_scalar(const struct lscov_bucket* b, u8* dst,
+    const u8* src, u32 len) {
+  const u64* src64 = (const u64 *)src;
+  u64* dst64 = (u64 *)dst;
+
+  for (u32 i = 0; i < len >> 3; i++) {
+    if (likely(!src64[i])) {
+      dst64[i] = 0;
+      continue;
+    }
+
+    const u8* s = (const u8 *)&src64[i];
+    u8* d = (u8 *)&dst64[i];
+    for (u32 j = 0; j < 8; j++)
+      d[j] = b->lut[s[j]];
+  }
+}
+
+#ifdef LSCOV_BUCKET_X86
+
+/* x >= lo, unsigned: max(x, lo) == x. Steps ascend, so blending every step
+ * in order leaves the value of the last one that x reached. */
+
+__attribute__((target("sse4.1")))
+static void lscov_bucket_sse41(const struct lscov_bucket* b, u8* dst,
+    const u8* src, u32 len) {
+  __m128i lo[BUCKET_STEPS_MAX], val[BUCKET_STEPS_MAX];
+  for (u32 s = 0; s < b->num_steps; s++) {
+    lo[s] = _mm_set1_epi8(b->lo[s]);
+    val[s] = _mm_set1_epi8(b->val[s]);
+  }
+
+  for (u32 i = 0; i < len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i out = _mm_setzero_si128();
+
+    if (!_mm_testz_si128(x, x)) {
+      for (u32 s = 0; s < b->num_steps; s++) {
+        __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(x, lo[s]), x);
+        out = _mm_blendv_epi8(out, val[s], ge);
+      }
+    }
+
+    _mm_storeu_si128((__m128i *)(dst + i), out);
+  }
+}
+
+__attribute__((target("avx2")))
+static void lscov_bucket_avx2(const struct lscov_bucket* b, u8* dst,
+    const u8* src, u32 len) {
+  __m256i lo[BUCKET_STEPS_MAX], val[BUCKET_STEPS_MAX];
+  for (u32 s = 0; s < b->num_steps; s++) {
+    lo[s] = _mm256_set1_epi8(b->lo[s]);
+    val[s] = _mm256_set1_epi8(b->val[s]);
+  }
+
+  for (u32 i = 0; i < len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i out = _mm256_setzero_si256();
+
+    if (!_mm256_testz_si256(x, x)) {
+      for (u32 s = 0; s < b->num_steps; s++) {
+        __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(x, lo[s]), x);
+        out = _mm256_blendv_epi8(out, val[s], ge);
+      }
+    }
+
+    _mm256_storeu_si256((__m256i *)(dst + i), out);
+  }
+}
+
+#endif /* ^LSCOV_BUCKET_X86 */
+
+/* Pick the best kernel for this CPU (and tell which one). */
+
+static inline lscov_bucket_fn lscov_bucket_select(const char** kernel) {
+#ifdef LSCOV_BUCKET_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    *kernel = "avx2";
+    return lscov_bucket_avx2;
+  }
+
+  if (__builtin_cpu_supports("sse4.1")) {
+    *kernel = "sse4.1";
+    return lscov_bucket_sse41;
+  }
+#endif
+
+  *kernel = "scalar";
+  return lscov_bucket_scalar;
+}
@@ -0,0 +1,350 @@
+/*
+ * lscov - channel
+ * ---------------
+ *
+ * Shared memory between the runtime (in the instrumented binary) and the
+ * daemon. The daemon creates it as a memfd (or as a named POSIX SHM object on
+ * request) and advertises it in LSCOV_CHANNEL, which the fuzzer and thus the
+ * instrumented binary inherit. Every daemon has its own channel, so any number
+ * of campaigns can run side by side, and a crashed daemon leaves nothing
+ * behind that blocks the next one.
+ *
+ * Layout: a header, 'num_slots' slot descriptors, and then 'num_slots' maps of
+ * 'map_size_max' bytes. An execution claims a slot, fills in its map, and marks
+ * it ready; the daemon reads the map and frees the slot. In the default
+ * (blocking) mode, there's one slot and every execution waits for it. In the
+ * non-blocking mode, an execution that finds no free slot runs unmeasured.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stuff.h"
+#include "hist.h"
+
+/* Environment variable naming the channel (a path to open) */
+
+#define LSCOV_CHAN_ENV      "LSCOV_CHANNEL"
+
+/* Header identification. Bump the version whenever the layout changes. */
+
+#define LSCOV_CHAN_MAGIC    0x4c53434f    // "LSCO"
+#define LSCOV_CHAN_VERSION  6
+
+/* Channel flags */
+
+#define LSCOV_CHAN_NONBLOCK 0x1     // Never wait for a slot
+#define LSCOV_CHAN_THREADS  0x2     // One map per thread
+#define LSCOV_CHAN_TIMING   0x4     // Time __lscov_start_exec()
+
+/* Slot count limit (keeps the header offset in 16 bits) */
+
+#define LSCOV_SLOTS_MAX     256
+
+/* Per-thread maps: a slot's map area is carved into maps of 'map_size' bytes,
+ * one for each thread the execution created (the first one being the main
+ * thread's). Threads beyond what fits share the main thread's. */
+
+#define LSCOV_THREADS_MAX   64
+
+/* How an execution ended. A producer that died without telling (e.g., killed
+ * by the fuzzer's timeout, as SIGKILL can't be caught) counts as a hang. */
+
+#define LSCOV_EXEC_OK       0
+#define LSCOV_EXEC_CRASH    1     // Caught a fatal signal
+#define LSCOV_EXEC_HANG     2     // Died silently
+
+/* Slot states. A ready slot also tells how the execution ended. */
+
+#define LSCOV_SLOT_FREE     0
+#define LSCOV_SLOT_BUSY     1
+#define LSCOV_SLOT_READY    2     // + LSCOV_EXEC_*
+
+/* Spin budget (in rounds) before going to sleep on a futex. Each side adapts
+ * its own between these bounds: doubled whenever spinning paid off, halved
+ * whenever it didn't. */
+
+#define LSCOV_SPIN_MIN      (1 << 4)
+#define LSCOV_SPIN_MAX      (1 << 14)
+
+struct lscov_chan_hdr {
+  u32   magic;          // LSCOV_CHAN_MAGIC
+  u16   version;        // LSCOV_CHAN_VERSION
+  u16   hdr_size;       // Offset of the first map
+  u32   map_size_max;   // Bytes available per map
+  u32   map_size;       // Bytes used by the binary (0: not attached yet)
+  u32   num_slots;      // Number of maps
+  u32   flags;          // LSCOV_CHAN_*
+  u32   sample_rate;    // Publish one execution in this many (0, 1: all)
+
+  /* Handshake. The RT rings 'seq_done' whenever it marks a slot ready, and
+   * waits on a slot's state for the daemon to free it. Each side counts itself
+   * in 'sleeping' before a futex wait, and the other side only takes the
+   * wake-up syscall if it sees a sleeper. Written by the RT: */
+  u32   seq_done __attribute__((aligned(64)));   // (futex) Slots made ready
+  u32   rt_sleeping;    // RTs waiting on a slot
+  u32   rt_spins;       // RT spin budget
+  u32   slot_cursor;    // Where to start looking for a free slot
+  u64   exec_tick;      // Executions started (measured or not)
+  u64   dropped;        // Sampled executions that found no free slot
+
+  /* Written by the daemon: */
+  u32   d_sleeping __attribute__((aligned(64)));  // Daemon waits on 'seq_done'
+  u32   d_spins;        // Daemon spin budget
+
+  /* Written by the RT (LSCOV_CHAN_TIMING): how long executions took to get
+   * going, mostly waiting for a slot. Lines of its own, as every measured
+   * execution writes to it. */
+  struct lscov_hist rt_wait __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+struct lscov_chan_slot {
+  u32   state;          // (futex) LSCOV_SLOT_*
+  u32   producer;       // PID of the process running on it (0: not yet)
+  u32   num_threads;    // Maps in use (LSCOV_CHAN_THREADS)
+} __attribute__((aligned(64)));
+
+/* A channel, as seen by its creator. */
+
+struct lscov_chan {
+  int   fd;
+  u64   size;
+  struct lscov_chan_hdr* hdr;
+  char  path[80];       // Value of LSCOV_CHANNEL
+  char  name[64];       // shm_open() name, if it has one
+};
+
+static inline u32 lscov_chan_hdr_size(u32 num_slots) {
+  return sizeof(struct lscov_chan_hdr) + 
+    num_slots * sizeof(struct lscov_chan_slot);
+}
+
+static inline u64 lscov_chan_size(u32 map_size_max, u32 num_slots) {
+  return lscov_chan_hdr_size(num_slots) + (u64)map_size_max * num_slots;
+}
+
+static inline struct lscov_chan_slot* lscov_chan_slot(
+    struct lscov_chan_hdr* hdr, u32 slot) {
+  return (struct lscov_chan_slot *)(hdr + 1) + slot;
+}
+
+static inline u8* lscov_chan_map(struct lscov_chan_hdr* hdr, u32 slot) {
+  return (u8 *)hdr + hdr->hdr_size + (u64)slot * hdr->map_size_max;
+}
+
+/* Futex wrappers. Channels are shared between processes, so no
+ * FUTEX_PRIVATE_FLAG. The timeout is absolute, in CLOCK_REALTIME. */
+
+static inline int lscov_futex_wait(u32* word, u32 val,
+    const struct timespec* deadline) {
+  return syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME,
+      val, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static inline int lscov_futex_wake(u32* word) {
+  return syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+static inline void lscov_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield" ::: "memory");
+#endif
+}
+
+/* Wait until '*word' is not 'old' any more: spin first, then sleep. Returns 0,
+ * or -1 if 'deadline' (if any) passed, or a signal came in before it. */
+
+static inline int lscov_chan_wait(u32* word, u32 old, u32* sleeping,
+    u32* spins, const struct timespec* deadline) {
+  u32 budget = __atomic_load_n(spins, __ATOMIC_RELAXED);
+  if (budget < LSCOV_SPIN_MIN || budget > LSCOV_SPIN_MAX)
+    budget = LSCOV_SPIN_MIN;
+
+  for (u32 i = 0; i < budget; i++) {
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old) {
+      if (budget < LSCOV_SPIN_MAX)
+        __atomic_store_n(spins, budget << 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    lscov_cpu_relax();
+  }
+
+  if (budget > LSCOV_SPIN_MIN)
+    __atomic_store_n(spins, budget >> 1, __ATOMIC_RELAXED);
+
+  /* Count ourselves in before checking the word for the last time, so that
+   * the waker either sees us or we see the new value. */
+  int ret = 0;
+  __atomic_fetch_add(sleeping, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old) {
+    if (lscov_futex_wait(word, old, deadline) && 
+        (errno == ETIMEDOUT || (deadline && errno == EINTR))) {
+      ret = -1;
+      break;
+    }
+  }
+  __atomic_fetch_sub(sleeping, 1, __ATOMIC_RELAXED);
+
+  return ret;
+}
+
+/* Set '*word' to 'val' and wake up the other side if it's asleep. */
+
+static inline void lscov_chan_post(u32* word, u32 val, u32* sleeping) {
+  __atomic_store_n(word, val, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST))
+    lscov_futex_wake(word);
+}
+
+/* Bump '*word' and wake up the other side if it's asleep. */
+
+static inline void lscov_chan_ring(u32* word, u32* sleeping) {
+  __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST))
+    lscov_futex_wake(word);
+}
+
+/* Is the process gone? A pidfd becomes readable when it exits, zombie or not
+ * (its parent may well be gone too, e.g., a fuzzer's timeout killing its own
+ * process group); older kernels have to do with /proc. */
+
+static inline int lscov_pid_dead(pid_t pid) {
+#ifdef SYS_pidfd_open
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0 && errno == ESRCH)
+    return 1;
+
+  if (pidfd >= 0) {
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    int dead = poll(&pfd, 1, 0) > 0;
+    close(pidfd);
+    return dead;
+  }
+#endif
+
+  char path[32];
+  char state = 0;
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 1;
+  if (fscanf(f, "%*d (%*[^)]) %c", &state) != 1)
+    state = 0;
+  fclose(f);
+
+  return state == 'Z' || state == 'X';
+}
+
+/* Create a channel. With 'name', it's a named POSIX SHM object (replacing a
+ * stale one, if any); otherwise it's a memfd reachable through /proc as long
+ * as we're alive. The maps are zero, and so is the handshake (ready for the
+ * first execution). */
+
+static inline void lscov_chan_create(struct lscov_chan* ch, const char* name,
+    u32 map_size_max, u32 num_slots, u32 flags, u32 sample_rate) {
+  memset(ch, 0, sizeof(struct lscov_chan));
+  ch->size = lscov_chan_size(map_size_max, num_slots);
+
+  if (name) {
+    snprintf(ch->name, sizeof(ch->name), "%s%s", name[0] == '/' ? "" : "/",
+        name);
+    shm_unlink(ch->name);
+
+    ch->fd = shm_open(ch->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (ch->fd < 0)
+      PFATAL("shm_open() for channel '%s' failed", ch->name);
+
+    snprintf(ch->path, sizeof(ch->path), "/dev/shm%s", ch->name);
+  } else {
+    ch->fd = memfd_create("lscov", MFD_CLOEXEC);
+    if (ch->fd < 0)
+      PFATAL("memfd_create() for channel failed");
+
+    snprintf(ch->path, sizeof(ch->path), "/proc/%d/fd/%d", getpid(), ch->fd);
+  }
+
+  if (ftruncate(ch->fd, ch->size))
+    PFATAL("ftruncate() for channel failed");
+
+  ch->hdr = mmap(0, ch->size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->fd, 0);
+  if (ch->hdr == MAP_FAILED)
+    PFATAL("mmap() for channel failed");
+
+  struct lscov_chan_hdr* hdr = ch->hdr;
+  hdr->version = LSCOV_CHAN_VERSION;
+  hdr->hdr_size = lscov_chan_hdr_size(num_slots);
+  hdr->map_size_max = map_size_max;
+  hdr->num_slots = num_slots;
+  hdr->flags = flags;
+  hdr->sample_rate = sample_rate;
+
+  MEM_BARRIER();
+  hdr->magic = LSCOV_CHAN_MAGIC;
+}
+
+static inline void lscov_chan_destroy(struct lscov_chan* ch) {
+  if (!ch->hdr)
+    return;
+
+  munmap(ch->hdr, ch->size);
+  close(ch->fd);
+
+  if (ch->name[0])
+    shm_unlink(ch->name);
+
+  ch->hdr = NULL;
+}
+
+/* Attach to the channel advertised in LSCOV_CHANNEL. Returns NULL if there's
+ * none, so that the binary can run without measurement. So does a channel
+ * that's gone or stale (left in the environment by a daemon that died or got
+ * restarted): failing every execution over it would only fake crashes. */
+
+static inline struct lscov_chan_hdr* lscov_chan_attach(void) {
+  const char* path = getenv(LSCOV_CHAN_ENV);
+  if (!path || !*path)
+    return NULL;
+
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    WARNF("(lscov) cannot open channel '%s', not measuring.", path);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct lscov_chan_hdr)) {
+    WARNF("(lscov) bogus channel '%s', not measuring.", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct lscov_chan_hdr* hdr = mmap(0, st.st_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED) {
+    WARNF("(lscov) cannot map channel '%s', not measuring.", path);
+    return NULL;
+  }
+
+  if (hdr->magic != LSCOV_CHAN_MAGIC || hdr->version != LSCOV_CHAN_VERSION ||
+      !hdr->num_slots ||
+      (u64)st.st_size < lscov_chan_size(hdr->map_size_max, hdr->num_slots)) {
+    WARNF("(lscov) channel version mismatch (rebuild the binary or daemon), "
+        "not measuring.");
+    munmap(hdr, st.st_size);
+    return NULL;
+  }
+
+  return hdr;
+}
@@ -5,30 +5,57 @@ import matplotlib.pyplot as plt
 import matplotlib.ticker as ticker
 import numpy as np
 import math
+import struct
 
-# Load CSV.
+# Load CSV, or its binary twin (lscov.csv.ts; see series.h).
 
 data = {}
 
-raw_data = []
-with open(sys.argv[1], "r") as f:
-    raw_data = f.readlines()
-
-idx_to_label = []
-labels = raw_data[0].strip().split(',')
-for label in labels:
-    idx_to_label += [label]
-    data[label] = []
-
-raw_data = raw_data[1:]
-
-for raw_datum in raw_data:
-    raw_datum_split = raw_datum.strip().split(',')
-    for i, d in enumerate(raw_datum_split):
-        if ('.' in d):
-            data[idx_to_label[i]] += [float(d)]
-        else:
-            data[idx_to_label[i]] += [int(d)]
+def load_series(path):
+    with open(path, "rb") as f:
+        raw = f.read()
+    magic, version, hdr_size, num_fields, record_size = \
+        struct.unpack_from("<8sIIII", raw, 0)
+    if (version != 1):
+        sys.exit("time series version mismatch ({})".format(version))
+    fields = []
+    for i in range(num_fields):
+        name, typ, digits = struct.unpack_from("<48sII", raw, 32 + i * 56)
+        fields += [(name.rstrip(b'\0').decode(), '<u8' if typ == 0 else '<f8')]
+    num_records = (len(raw) - hdr_size) // record_size
+    records = np.frombuffer(raw, dtype=np.dtype(fields), count=num_records,
+        offset=hdr_size)
+    for name, _ in fields:
+        data[name] = records[name].tolist()
+
+def load_csv(path):
+    raw_data = []
+    with open(path, "r") as f:
+        raw_data = f.readlines()
+
+    idx_to_label = []
+    labels = raw_data[0].strip().split(',')
+    for label in labels:
+        idx_to_label += [label]
+        data[label] = []
+
+    raw_data = raw_data[1:]
+
+    for raw_datum in raw_data:
+        raw_datum_split = raw_datum.strip().split(',')
+        for i, d in enumerate(raw_datum_split):
+            if ('.' in d):
+                data[idx_to_label[i]] += [float(d)]
+            else:
+                data[idx_to_label[i]] += [int(d)]
+
+with open(sys.argv[1], "rb") as f:
+    is_series = f.read(8) == b'LSCOVTS\0'
+
+if (is_series):
+    load_series(sys.argv[1])
+else:
+    load_csv(sys.argv[1])
 
 # Draw figures.
 
@@ -131,7 +158,7 @@ ax[1].legend(["Inst", "Avg"], loc="upper right")
 ax[1].xaxis.set_major_formatter(time_fmt)
 ax[1].xaxis.set_major_locator(ticker.MultipleLocator(time_unit_in_sec))
 
-ax[2].plot(data['Time'], data['RateE(ins)'], color='C2', alpha=0.5)
+ax[2].plot(data['Time'], data['RateE(per)'], color='C2', alpha=0.5)
 ax[2].plot(data['Time'], data['RateE(avg)'], color='C2', linewidth=2)
 ax[2].set_xlabel("Time ({})".format(time_unit_in_str))
 ax[2].set_ylabel("New Coverage (/exec)")
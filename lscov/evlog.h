@@ -0,0 +1,158 @@
+/*
+ * lscov - event log
+ * -----------------
+ *
+ * One event per measured logic state: when, which execution, whose, its
+ * fingerprint, and whether it was new. Events come in blocks that decode on
+ * their own (each has its own base time and execution number), packed as
+ * varint deltas. The fingerprint takes 8 bytes, the rest a few in total.
+ * Times are taken from a monotonic clock, relative to the start; only the
+ * header tells the wall-clock time, so clock steps can't reorder events.
+ *
+ *   header | block header | events... | block header | events... | ...
+ */
+
+#pragma once
+
+#include "stuff.h"
+
+#define LSCOV_EVLOG_MAGIC       "LSCOVEL"
+#define LSCOV_EVLOG_VERSION     2
+#define LSCOV_EVBLOCK_MAGIC     0x4b4c4245    // "EBLK"
+#define LSCOV_EVBLOCK_EVENTS    4096          // Events per block, at most
+
+/* Per event: up to 10 bytes for each varint, plus the fingerprint. */
+#define LSCOV_EVBLOCK_SIZE_MAX  (LSCOV_EVBLOCK_EVENTS * (3 * 10 + 8))
+
+#define LSCOV_EVENT_NEW         0x1           // First seen (per the filter)
+
+struct lscov_event {
+  u64         time_us;            // Since the start (monotonic), in us
+  u64         exec;               // Execution number (1-based)
+  u32         producer;           // PID of the execution
+  u32         flags;              // LSCOV_EVENT_*
+  u64         fp;                 // Logic state fingerprint
+};
+
+struct lscov_evlog_hdr {
+  char        magic[8];           // LSCOV_EVLOG_MAGIC
+  u32         version;            // LSCOV_EVLOG_VERSION
+  u32         hdr_size;           // Blocks start here
+  u64         start_time_us;      // Measurement start (Unix time, in us)
+  u64         reserved;
+};
+
+struct lscov_evblock_hdr {
+  u32         magic;              // LSCOV_EVBLOCK_MAGIC
+  u32         num_events;
+  u32         size;               // Encoded events, in bytes
+  u32         reserved;
+  u64         base_time_us;       // Deltas of the first event are from these
+  u64         base_exec;
+};
+
+static inline u8* lscov_varint_put(u8* p, u64 v) {
+  while (v >= 0x80) {
+    *p++ = (u8)v | 0x80;
+    v >>= 7;
+  }
+  *p++ = (u8)v;
+  return p;
+}
+
+static inline const u8* lscov_varint_get(const u8* p, const u8* end, u64* v) {
+  u64 r = 0;
+  for (u32 shift = 0; p < end && shift < 64; shift += 7) {
+    u8 b = *p++;
+    r |= (u64)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static inline u64 lscov_zigzag(s64 v) {
+  return ((u64)v << 1) ^ (u64)(v >> 63);
+}
+
+static inline s64 lscov_unzigzag(u64 v) {
+  return (s64)(v >> 1) ^ -(s64)(v & 1);
+}
+
+/* Encode 'num_events' events into a block at 'out' (LSCOV_EVBLOCK_SIZE_MAX
+ * plus the header, at most). Returns its total size. Times and execution
+ * numbers don't go backwards within a block. */
+
+static inline u32 lscov_evblock_encode(u8* out, const struct lscov_event* ev,
+    u32 num_events) {
+  struct lscov_evblock_hdr* hdr = (struct lscov_evblock_hdr *)out;
+  u8* p = out + sizeof(*hdr);
+
+  hdr->magic = LSCOV_EVBLOCK_MAGIC;
+  hdr->num_events = num_events;
+  hdr->reserved = 0;
+  hdr->base_time_us = num_events ? ev[0].time_us : 0;
+  hdr->base_exec = num_events ? ev[0].exec : 0;
+
+  u64 time_us = hdr->base_time_us;
+  u64 exec = hdr->base_exec;
+  u32 producer = 0;
+
+  for (u32 i = 0; i < num_events; i++) {
+    p = lscov_varint_put(p, ev[i].time_us - time_us);
+    p = lscov_varint_put(p, (ev[i].exec - exec) << 1 |
+        (ev[i].flags & LSCOV_EVENT_NEW));
+    p = lscov_varint_put(p, lscov_zigzag((s64)ev[i].producer - producer));
+    memcpy(p, &ev[i].fp, sizeof(u64));
+    p += sizeof(u64);
+
+    time_us = ev[i].time_us;
+    exec = ev[i].exec;
+    producer = ev[i].producer;
+  }
+
+  hdr->size = p - out - sizeof(*hdr);
+  return p - out;
+}
+
+/* Decode a block's events into 'ev' (LSCOV_EVBLOCK_EVENTS long). Returns the
+ * number of events, or -1 if the block is bogus (including times or
+ * execution numbers that go backwards). */
+
+static inline int lscov_evblock_decode(const struct lscov_evblock_hdr* hdr,
+    struct lscov_event* ev) {
+  if (hdr->magic != LSCOV_EVBLOCK_MAGIC ||
+      hdr->num_events > LSCOV_EVBLOCK_EVENTS ||
+      hdr->size > LSCOV_EVBLOCK_SIZE_MAX)
+    return -1;
+
+  const u8* p = (const u8 *)(hdr + 1);
+  const u8* end = p + hdr->size;
+  u64 time_us = hdr->base_time_us;
+  u64 exec = hdr->base_exec;
+  u32 producer = 0;
+
+  for (u32 i = 0; i < hdr->num_events; i++) {
+    u64 dt, dx, dp;
+    if (!(p = lscov_varint_get(p, end, &dt)) ||
+        !(p = lscov_varint_get(p, end, &dx)) ||
+        !(p = lscov_varint_get(p, end, &dp)) || p + sizeof(u64) > end ||
+        dt >> 63 || dx >> 63)
+      return -1;
+
+    time_us += dt;
+    exec += dx >> 1;
+    producer += lscov_unzigzag(dp);
+
+    ev[i].time_us = time_us;
+    ev[i].exec = exec;
+    ev[i].producer = producer;
+    ev[i].flags = dx & LSCOV_EVENT_NEW;
+    memcpy(&ev[i].fp, p, sizeof(u64));
+    p += sizeof(u64);
+  }
+
+  return hdr->num_events;
+}
@@ -0,0 +1,249 @@
+/*
+ * lscov - logic state hashes
+ * --------------------------
+ *
+ * Hashes of a whole logic state (a map of lstate_size bytes, mostly zeros).
+ * The daemon's Bloom filter takes one seeded 32-bit Murmur3 per index, the
+ * first two making the fingerprint. The rest are candidates to replace it,
+ * compared by lscov-hash-bench: 64-bit hashes, whose halves give all the
+ * indices by double hashing (a + i * b), as the scalable filter does.
+ *
+ *  - CRC32C: four interleaved streams of the SSE4.2 instruction, mixed.
+ *  - Multilinear: the sum of every 32-bit word times a random 64-bit key of
+ *    its own, top half kept, twice over (Lemire and Kaser). Zero words add
+ *    nothing, so all-zero blocks are skipped, as in bucketing.
+ */
+
+#pragma once
+
+#include "stuff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define LSCOV_HASH_X86
+#endif
+
+static inline u32 lscov_hash_murmur3(const u8 *key, u32 len, u32 seed) {
+  /* MurmurHash implementation by Joseph Werle.
+   * (https://github.com/jwerle/murmurhash.c/blob/master/murmurhash.c)
+   * Copyright (c) 2014-2022 joseph werle <joseph.werle@gmail.com> */
+
+  u32 c1 = 0xcc9e2d51;
+  u32 c2 = 0x1b873593;
+  u32 r1 = 15;
+  u32 r2 = 13;
+  u32 m = 5;
+  u32 n = 0xe6546b64;
+  u32 h = 0;
+  u32 k = 0;
+  u8 *d = (u8 *) key; // 32 bit extract from `key'
+  const u32 *chunks = NULL;
+  const u8 *tail = NULL; // tail - last 8 bytes
+  int i = 0;
+  int l = len / 4; // chunk length
+
+  h = seed;
+
+  chunks = (const u32 *) (d + l * 4); // body
+  tail = (const u8 *) (d + l * 4); // last 8 byte chunk of `key'
+
+  // for each 4 byte chunk of `key'
+  for (i = -l; i != 0; ++i) {
+    // next 4 byte chunk of `key'
+    k = chunks[i];
+
+    // encode next 4 byte chunk of `key'
+    k *= c1;
+    k = (k << r1) | (k >> (32 - r1));
+    k *= c2;
+
+    // append to hash
+    h ^= k;
+    h = (h << r2) | (h >> (32 - r2));
+    h = h * m + n;
+  }
+
+  k = 0;
+
+  // remainder
+  switch (len & 3) { // `len % 4'
+    case 3: k ^= (tail[2] << 16);
+    case 2: k ^= (tail[1] << 8);
+
+    case 1:
+      k ^= tail[0];
+      k *= c1;
+      k = (k << r1) | (k >> (32 - r1));
+      k *= c2;
+      h ^= k;
+    case 0:;
+  }
+
+  h ^= len;
+
+  h ^= (h >> 16);
+  h *= 0x85ebca6b;
+  h ^= (h >> 13);
+  h *= 0xc2b2ae35;
+  h ^= (h >> 16);
+
+  return h;
+}
+
+/* Murmur3's 64-bit finalizer. */
+
+static inline u64 lscov_hash_fmix64(u64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* The filter indices of a 64-bit hash, by double hashing. */
+
+static inline u32 lscov_hash_index(u64 h, u32 i, u32 size_bits) {
+  return ((u64)(u32)(h >> 32) + (u64)i * ((u32)h | 1)) % size_bits;
+}
+
+#ifdef LSCOV_HASH_X86
+
+/* 'len' is a multiple of LSTATE_ALIGN, so each stream gets whole words. */
+
+__attribute__((target("sse4.2")))
+static inline u64 lscov_hash_crc32c(const u8* data, u32 len, u64 seed) {
+  u32 quarter = len >> 2;
+  const u8* p = data;
+  u64 c0 = (u32)seed, c1 = ~(u32)seed;
+  u64 c2 = (u32)(seed >> 32), c3 = ~(u32)(seed >> 32);
+
+  for (u32 i = 0; i < quarter; i += 8) {
+    c0 = _mm_crc32_u64(c0, *(const u64 *)(p + i));
+    c1 = _mm_crc32_u64(c1, *(const u64 *)(p + quarter + i));
+    c2 = _mm_crc32_u64(c2, *(const u64 *)(p + 2 * quarter + i));
+    c3 = _mm_crc32_u64(c3, *(const u64 *)(p + 3 * quarter + i));
+  }
+
+  return lscov_hash_fmix64((c0 << 32 | c1) ^
+      lscov_hash_fmix64((c2 << 32 | c3) ^ len));
+}
+
+#endif /* ^LSCOV_HASH_X86 */
+
+/* Multilinear keys: one per 32-bit word and stream. Within every 8 words,
+ * the keys of the even words come first, then the odd ones', which is how a
+ * 256-bit multiply takes them. */
+
+struct lscov_ml_key {
+  u32         len;                // Bytes covered
+  u64         init[2];            // Added to each stream
+  u64*        key[2];             // len / 4 keys per stream
+};
+
+static inline u32 lscov_ml_key_pos(u32 word) {
+  u32 pos = word & 7;
+  return (word & ~7) + (pos & 1 ? 4 : 0) + (pos >> 1);
+}
+
+static inline void lscov_ml_key_init(struct lscov_ml_key* k, u32 len,
+    u64 seed) {
+  k->len = len;
+  for (u32 s = 0; s < 2; s++) {
+    k->key[s] = malloc((len >> 2) * sizeof(u64));
+    if (!k->key[s])
+      PFATAL("multilinear key allocation failed.");
+
+    /* SplitMix64 */
+    for (u32 i = 0; i <= len >> 2; i++) {
+      u64 z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      z ^= z >> 31;
+      if (i < len >> 2)
+        k->key[s][i] = z;
+      else
+        k->init[s] = z;
+    }
+  }
+}
+
+typedef u64 (*lscov_ml_fn)(const struct lscov_ml_key*, const u8*);
+
+static u64 lscov_hash_ml_scalar(const struct lscov_ml_key* k,
+    const u8* data) {
+  const u64* data64 = (const u64 *)data;
+  u64 sum[2] = { k->init[0], k->init[1] };
+
+  for (u32 i = 0; i < k->len >> 3; i++) {
+    if (likely(!data64[i]))
+      continue;
+
+    const u32* w = (const u32 *)&data64[i];
+    for (u32 j = 0; j < 2; j++) {
+      u32 pos = lscov_ml_key_pos(i * 2 + j);
+      sum[0] += w[j] * k->key[0][pos];
+      sum[1] += w[j] * k->key[1][pos];
+    }
+  }
+
+  return (sum[0] & 0xffffffff00000000ULL) | (sum[1] >> 32);
+}
+
+#ifdef LSCOV_HASH_X86
+
+/* m * k (mod 2^64), for the 32-bit 'm' in the low half of each lane:
+ * m * lo(k) + (m * hi(k) << 32). */
+
+__attribute__((target("avx2")))
+static inline __m256i lscov_ml_mul(__m256i m, __m256i k) {
+  return _mm256_add_epi64(_mm256_mul_epu32(m, k),
+      _mm256_slli_epi64(_mm256_mul_epu32(m, _mm256_srli_epi64(k, 32)), 32));
+}
+
+__attribute__((target("avx2")))
+static u64 lscov_hash_ml_avx2(const struct lscov_ml_key* k, const u8* data) {
+  __m256i acc[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+
+  for (u32 i = 0; i < k->len; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(data + i));
+    if (_mm256_testz_si256(x, x))
+      continue;
+
+    __m256i even = x, odd = _mm256_srli_epi64(x, 32);
+    for (u32 s = 0; s < 2; s++) {
+      const u64* key = k->key[s] + (i >> 2);
+      __m256i prod = _mm256_add_epi64(
+          lscov_ml_mul(even, _mm256_loadu_si256((const __m256i *)key)),
+          lscov_ml_mul(odd, _mm256_loadu_si256((const __m256i *)(key + 4))));
+      acc[s] = _mm256_add_epi64(acc[s], prod);
+    }
+  }
+
+  u64 sum[2];
+  for (u32 s = 0; s < 2; s++) {
+    u64 lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc[s]);
+    sum[s] = k->init[s] + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  return (sum[0] & 0xffffffff00000000ULL) | (sum[1] >> 32);
+}
+
+#endif /* ^LSCOV_HASH_X86 */
+
+/* Pick the best multilinear kernel for this CPU (and tell which one). */
+
+static inline lscov_ml_fn lscov_hash_ml_select(const char** kernel) {
+#ifdef LSCOV_HASH_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    *kernel = "avx2";
+    return lscov_hash_ml_avx2;
+  }
+#endif
+
+  *kernel = "scalar";
+  return lscov_hash_ml_scalar;
+}
@@ -0,0 +1,103 @@
+/*
+ * lscov - latency histograms
+ * --------------------------
+ *
+ * Log-scale histograms of nanoseconds, HDR style: every power of two is split
+ * into LSCOV_HIST_SUB linear sub-buckets, so a bucket is at most 12.5% wide
+ * (values below LSCOV_HIST_SUB get one each), up to 2^34 ns (17 s), the
+ * last bucket taking everything beyond.
+ *
+ * A histogram in the channel is updated by any number of processes at once
+ * (atomically); one of the daemon's by a single thread. Readers never lock;
+ * they may see a sample counted but not yet summed, which monitoring can
+ * live with.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include "stuff.h"
+
+#define LSCOV_HIST_SUB_BITS 3
+#define LSCOV_HIST_SUB      (1 << LSCOV_HIST_SUB_BITS)
+#define LSCOV_HIST_BUCKETS  (32 * LSCOV_HIST_SUB)
+
+struct lscov_hist {
+  u64         count[LSCOV_HIST_BUCKETS];
+  u64         sum_ns;
+};
+
+static inline u64 lscov_now_ns() {
+  /* Not slewed by NTP, and still a vDSO call (no syscall). */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline u32 lscov_hist_bucket(u64 ns) {
+  if (ns < LSCOV_HIST_SUB)
+    return ns;
+
+  u32 msb = 63 - __builtin_clzll(ns);
+  u32 b = (msb - LSCOV_HIST_SUB_BITS + 1) * LSCOV_HIST_SUB +
+    ((ns >> (msb - LSCOV_HIST_SUB_BITS)) & (LSCOV_HIST_SUB - 1));
+  return b < LSCOV_HIST_BUCKETS ? b : LSCOV_HIST_BUCKETS - 1;
+}
+
+/* Bucket 'b' holds values from lscov_hist_lower(b) up to (but not)
+ * lscov_hist_lower(b + 1). */
+
+static inline u64 lscov_hist_lower(u32 b) {
+  if (b < LSCOV_HIST_SUB)
+    return b;
+
+  u32 shift = b / LSCOV_HIST_SUB - 1;
+  return (u64)(LSCOV_HIST_SUB + b % LSCOV_HIST_SUB) << shift;
+}
+
+static inline void lscov_hist_add(struct lscov_hist* h, u64 ns) {
+  /* Single writer: plain increments, published as whole words. */
+  u32 b = lscov_hist_bucket(ns);
+  __atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum_ns, h->sum_ns + ns, __ATOMIC_RELAXED);
+}
+
+static inline void lscov_hist_add_shared(struct lscov_hist* h, u64 ns) {
+  __atomic_fetch_add(&h->count[lscov_hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+}
+
+/* Quantiles 'q' (0 to 1) of what's been added since 'prev' (a copy taken
+ * earlier), each as the middle of its bucket, in nanoseconds. Updates 'prev',
+ * and returns how many were added. */
+
+static inline u64 lscov_hist_quantiles(const struct lscov_hist* h,
+    struct lscov_hist* prev, const double* q, double* out, u32 num_q) {
+  u64 delta[LSCOV_HIST_BUCKETS];
+  u64 total = 0;
+
+  for (u32 b = 0; b < LSCOV_HIST_BUCKETS; b++) {
+    u64 c = __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+    delta[b] = c - prev->count[b];
+    prev->count[b] = c;
+    total += delta[b];
+  }
+
+  for (u32 i = 0; i < num_q; i++) {
+    u64 rank = (u64)(q[i] * total + 0.5), cum = 0;
+    if (!rank)
+      rank = 1;
+
+    out[i] = 0;
+    for (u32 b = 0; total && b < LSCOV_HIST_BUCKETS; b++) {
+      cum += delta[b];
+      if (cum >= rank) {
+        out[i] = (lscov_hist_lower(b) + lscov_hist_lower(b + 1)) / 2.0;
+        break;
+      }
+    }
+  }
+
+  return total;
+}
@@ -0,0 +1,503 @@
+/*
+ * lscov - ingest benchmark
+ * ------------------------
+ *
+ * How many executions a second the daemon takes in, how long they wait for
+ * it, and what it costs, with no fuzzer in the way. Runs lscov-daemon once per
+ * mode (a set of its options) with ourselves as the binary: a producer
+ * speaking the runtime's side of the channel (see lscov-llvm-rt.a.c), which
+ * publishes synthetic hit count maps as fast as the daemon lets it.
+ *
+ * Started under a daemon of your own (LSCOV_CHANNEL set), it's just the
+ * producer.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stuff.h"
+#include "channel.h"
+#include "series.h"
+#include "hist.h"
+
+/* Touch patterns: where an execution's hit counts land in the map. */
+
+#define PATTERN_RANDOM    0   // Anywhere (the worst case for the cache)
+#define PATTERN_CLUSTER   1   // Runs of neighbors, like a function's blocks
+#define PATTERN_STRIDE    2   // Evenly spread
+
+#define CLUSTER_LEN       16
+#define POOL_SIZE         1024  // Logic states that keep coming back
+#define MODES_MAX         32
+#define PRODUCERS_MAX     64
+
+#define RESULT_ENV        "LSCOV_BENCH_OUT"
+
+/* Parameters */
+
+u64         num_execs = 1000000;       // Executions per mode
+u32         map_size = LSTATE_SIZE;    // Map size, in bytes
+double      density = 0.01;            // Share of the map hit per execution
+double      novelty = 0.01;            // Share of executions new to the daemon
+u8          pattern = PATTERN_CLUSTER; // PATTERN_*
+u32         num_producers = 1;         // Producer processes
+const char* daemon_path = NULL;        // lscov-daemon (NULL: next to us)
+char*       work_dir = NULL;           // Daemon outputs (NULL: temporary)
+u8          verbose = 0;               // Show the daemon's output?
+char*       modes[MODES_MAX];          // Daemon options, per mode
+u32         num_modes;
+
+static char* default_modes[] = {
+  "", "-b log2", "-b none", "-g", "-e 5", "-f 4096", "-k 32",
+  "-v edge,bedge:log2", "-l", "-N -n 8",
+};
+
+static const char* pattern_names[] = { "random", "cluster", "stride" };
+
+/* What the producers saw, shared between them. */
+
+struct bench_stats {
+  struct lscov_hist wait;             // Time to get a slot
+  u64         measured;               // Executions published
+  u64         dropped;                // ... and not (no free slot)
+};
+
+
+/* Producer */
+
+static inline u64 splitmix64(u64* x) {
+  u64 z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void fill_map(u8* map, u64 seed) {
+  /* A logic state is its seed: the same seed, the same hit counts. */
+  u32 hits = density * map_size;
+  if (!hits)
+    hits = 1;
+
+  u64 x = seed;
+  u64 r;
+
+  switch (pattern) {
+  case PATTERN_RANDOM:
+    for (u32 i = 0; i < hits; i++) {
+      r = splitmix64(&x);
+      map[(r >> 32) % map_size] = 1 + (r & 15);
+    }
+    break;
+
+  case PATTERN_CLUSTER:
+    for (u32 i = 0; i < hits; i += CLUSTER_LEN) {
+      r = splitmix64(&x);
+      u32 base = (r >> 32) % (map_size - CLUSTER_LEN);
+      for (u32 j = 0; j < CLUSTER_LEN && i + j < hits; j++)
+        map[base + j] = 1 + ((r >> (j * 2)) & 15);
+    }
+    break;
+
+  case PATTERN_STRIDE: {
+    u32 step = map_size / hits;
+    u32 offset = splitmix64(&x) % step;
+    for (u32 i = 0; i < hits; i++)
+      map[offset + i * step] = 1 + (splitmix64(&x) & 15);
+    break;
+  }
+  }
+}
+
+/* Claim a slot, the way the runtime does: in the blocking mode, wait for the
+ * only one; otherwise, take any free one or none. */
+
+static struct lscov_chan_slot* claim_slot(struct lscov_chan_hdr* hdr) {
+  struct lscov_chan_slot* slot;
+  u32 state;
+
+  if (hdr->flags & LSCOV_CHAN_NONBLOCK) {
+    u32 start = __atomic_fetch_add(&hdr->slot_cursor, 1, __ATOMIC_RELAXED);
+
+    for (u32 i = 0; i < hdr->num_slots; i++) {
+      slot = lscov_chan_slot(hdr, (start + i) % hdr->num_slots);
+      state = LSCOV_SLOT_FREE;
+      if (__atomic_compare_exchange_n(&slot->state, &state, LSCOV_SLOT_BUSY,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return slot;
+    }
+
+    __atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  slot = lscov_chan_slot(hdr, 0);
+  while (1) {
+    state = LSCOV_SLOT_FREE;
+    if (__atomic_compare_exchange_n(&slot->state, &state, LSCOV_SLOT_BUSY,
+          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return slot;
+
+    lscov_chan_wait(&slot->state, state, &hdr->rt_sleeping, &hdr->rt_spins,
+        NULL);
+  }
+}
+
+static void produce(struct lscov_chan_hdr* hdr, struct bench_stats* stats,
+    u32 id, u64 execs) {
+  u64 rng = 0x6c73636f76ULL + id;
+  u64 fresh = (u64)id << 40;
+  pid_t pid = getpid();
+
+  for (u64 i = 0; i < execs; i++) {
+    /* A new logic state, or one of the pool's (new only the first time). */
+    u64 r = splitmix64(&rng);
+    u64 seed = (r >> 11) * 0x1.0p-53 < novelty ?
+      fresh++ : (1ULL << 63) | (r % POOL_SIZE);
+
+    /* Deterministic 1-in-N sampling */
+    u64 tick = __atomic_fetch_add(&hdr->exec_tick, 1, __ATOMIC_RELAXED);
+    if (hdr->sample_rate > 1 && tick % hdr->sample_rate)
+      continue;
+
+    u64 start_ns = lscov_now_ns();
+    struct lscov_chan_slot* slot = claim_slot(hdr);
+    if (!slot) {
+      __atomic_fetch_add(&stats->dropped, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    u64 wait_ns = lscov_now_ns() - start_ns;
+    lscov_hist_add_shared(&stats->wait, wait_ns);
+    if (hdr->flags & LSCOV_CHAN_TIMING)
+      lscov_hist_add_shared(&hdr->rt_wait, wait_ns);
+
+    u8* map = lscov_chan_map(hdr, slot - lscov_chan_slot(hdr, 0));
+    memset(map, 0, map_size);
+    __atomic_store_n(&slot->producer, pid, __ATOMIC_RELEASE);
+    fill_map(map, seed);
+
+    slot->num_threads = 1;
+    u32 busy = LSCOV_SLOT_BUSY;
+    if (__atomic_compare_exchange_n(&slot->state, &busy,
+          LSCOV_SLOT_READY + LSCOV_EXEC_OK, 0, __ATOMIC_SEQ_CST,
+          __ATOMIC_RELAXED))
+      lscov_chan_ring(&hdr->seq_done, &hdr->d_sleeping);
+
+    __atomic_fetch_add(&stats->measured, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static double rusage_cpu(int who) {
+  struct rusage ru;
+  getrusage(who, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void producer_main(struct lscov_chan_hdr* hdr) {
+  if (map_size > hdr->map_size_max)
+    FATAL("map size %u exceeds the daemon's %u", map_size,
+        hdr->map_size_max);
+
+  /* Telling the map size starts the daemon, as an instrumented binary does. */
+  if (!hdr->map_size)
+    lscov_chan_post(&hdr->map_size, map_size, &hdr->d_sleeping);
+  else if (hdr->map_size != map_size)
+    FATAL("map size mismatch (ours: %u, daemon: %u)", map_size,
+        hdr->map_size);
+
+  struct bench_stats* stats = mmap(0, sizeof(struct bench_stats),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED)
+    PFATAL("mmap() for stats failed");
+
+  u64 start_ns = lscov_now_ns();
+
+  for (u32 p = 1; p < num_producers; p++) {
+    pid_t pid = fork();
+    if (pid < 0)
+      PFATAL("fork() for producer failed");
+    if (!pid) {
+      produce(hdr, stats, p, num_execs / num_producers);
+      _exit(0);
+    }
+  }
+
+  produce(hdr, stats, 0, num_execs - num_execs / num_producers *
+      (num_producers - 1));
+  while (wait(NULL) > 0);
+
+  double seconds = (lscov_now_ns() - start_ns) / 1e9;
+  double cpu = rusage_cpu(RUSAGE_SELF) + rusage_cpu(RUSAGE_CHILDREN);
+
+  static const double q[2] = { 0.5, 0.99 };
+  static struct lscov_hist none;
+  double wait[2];
+  lscov_hist_quantiles(&stats->wait, &none, q, wait, 2);
+
+  const char* out_path = getenv(RESULT_ENV);
+  FILE* out = out_path ? fopen(out_path, "w") : stdout;
+  if (!out)
+    PFATAL("cannot open '%s'", out_path);
+
+  fprintf(out, "%lu %lu %f %f %f %f\n", stats->measured, stats->dropped,
+      seconds, cpu, wait[0] / 1000, wait[1] / 1000);
+  if (out != stdout)
+    fclose(out);
+}
+
+
+/* Driver */
+
+static const union lscov_series_value* series_last(
+    const struct lscov_series_hdr* hdr, u64 file_size) {
+  u64 num_records = lscov_series_num_records(hdr, file_size);
+  return num_records ? lscov_series_record(hdr, num_records - 1) : NULL;
+}
+
+static double series_get(const struct lscov_series_hdr* hdr,
+    const union lscov_series_value* rec, const char* name) {
+  for (u32 i = 0; rec && i < hdr->num_fields; i++)
+    if (!strcmp(hdr->fields[i].name, name))
+      return hdr->fields[i].type == LSCOV_SERIES_U64 ? rec[i].u : rec[i].f;
+  return 0;
+}
+
+static void run_mode(u32 m, char** self_argv) {
+  char *out_path, *res_path, *log_path, *ts_path;
+  if (asprintf(&out_path, "%s/mode%u.csv", work_dir, m) < 0 ||
+      asprintf(&res_path, "%s/mode%u.res", work_dir, m) < 0 ||
+      asprintf(&log_path, "%s/mode%u.log", work_dir, m) < 0 ||
+      asprintf(&ts_path, "%s.ts", out_path) < 0)
+    PFATAL("asprintf() failed");
+  unlink(res_path);
+
+  /* lscov-daemon -L -o <out> <mode> -- <us> <our arguments> */
+  char* args[256];
+  u32 n = 0;
+  char* mode = strdup(modes[m]);
+  args[n++] = (char *)daemon_path;
+  args[n++] = "-L";
+  args[n++] = "-o";
+  args[n++] = out_path;
+  for (char* tok = strtok(mode, " "); tok && n < 128; tok = strtok(NULL, " "))
+    args[n++] = tok;
+  args[n++] = "--";
+  for (u32 i = 0; self_argv[i] && n < 255; i++)
+    args[n++] = self_argv[i];
+  args[n] = NULL;
+
+  setenv(RESULT_ENV, res_path, 1);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    PFATAL("fork() for the daemon failed");
+  if (!pid) {
+    if (!verbose) {
+      FILE* log = fopen(log_path, "w");
+      if (log) {
+        dup2(fileno(log), 1);
+        dup2(fileno(log), 2);
+      }
+    }
+    execv(daemon_path, args);
+    PFATAL("cannot execute '%s'", daemon_path);
+  }
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0)
+    PFATAL("wait4() failed");
+
+  u64 measured, dropped;
+  double seconds, cpu, wait_p50, wait_p99;
+  FILE* res = fopen(res_path, "r");
+  int num_read = res ? fscanf(res, "%lu %lu %lf %lf %lf %lf", &measured, 
+      &dropped, &seconds, &cpu, &wait_p50, &wait_p99) : 0;
+  if (res)
+    fclose(res);
+
+  struct stat st;
+  if (num_read != 6) {
+    WARNF("mode '%s' failed (see %s)", modes[m], log_path);
+  } else if (stat(ts_path, &st) || 
+      st.st_size < (off_t)sizeof(struct lscov_series_hdr)) {
+    WARNF("mode '%s' left no time series (see %s)", modes[m], log_path);
+  } else {
+    /* wait4() counts the daemon and the producers it waited for; the rest
+     * is the daemon's own. */
+    double daemon_cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6 - cpu;
+
+    /* The daemon's side of it, from its last row. */
+    u64 ts_size;
+    const struct lscov_series_hdr* ts = lscov_series_map(ts_path, &ts_size);
+    const union lscov_series_value* rec = series_last(ts, ts_size);
+
+    SAYF("%-22s %10.0f %8.2f%% %8.2f %8.2f %8.2f %8.2f %9.2f %10.0f\n",
+        modes[m][0] ? modes[m] : "(default)", measured / seconds,
+        measured + dropped ? dropped * 100.0 / (measured + dropped) : 0,
+        wait_p50, wait_p99,
+        series_get(ts, rec, "IngestP50(us)"),
+        series_get(ts, rec, "IngestP99(us)"),
+        measured ? daemon_cpu * 1e6 / measured : 0,
+        series_get(ts, rec, "Coverage"));
+
+    munmap((void *)ts, ts_size);
+  }
+
+  free(mode);
+  free(out_path);
+  free(res_path);
+  free(log_path);
+  free(ts_path);
+}
+
+static void usage(const char* argv0) {
+  SAYF("Usage: %s [options]\n\n"
+       "    -n <execs>     executions per mode (default: %lu)\n"
+       "    -s <KiB>       map size (default: %u)\n"
+       "    -D <percent>   share of the map hit per execution (default: %g)\n"
+       "    -u <percent>   share of executions with a new logic state "
+       "(default: %g)\n"
+       "    -p <pattern>   where the hits land: random, cluster, stride "
+       "(default: %s)\n"
+       "    -P <procs>     producer processes (default: %u)\n"
+       "    -m <options>   daemon options of a mode (repeatable; default: "
+       "a built-in set)\n"
+       "    -d <path>      lscov-daemon (default: next to %s)\n"
+       "    -w <dir>       where the daemon writes (default: a new one in "
+       "/tmp)\n"
+       "    -v             show the daemon's output\n",
+       argv0, num_execs, map_size >> 10, density * 100, novelty * 100,
+       pattern_names[pattern], num_producers, argv0);
+  exit(1);
+}
+
+void arg_parse(int argc, char** argv) {
+  int c;
+  while ((c = getopt(argc, argv, "+n:s:D:u:p:P:m:d:w:v")) != -1) {
+    switch (c) {
+    case 'n':
+      num_execs = strtoull(optarg, NULL, 0);
+      if (!num_execs)
+        FATAL("bad number of executions");
+      break;
+    case 's':
+      map_size = atoi(optarg) << 10;
+      if (map_size < (1 << 10) || map_size > LSTATE_SIZE_MAX)
+        FATAL("bad map size (1 to %u KiB)", LSTATE_SIZE_MAX >> 10);
+      break;
+    case 'D':
+      density = atof(optarg) / 100;
+      if (density <= 0 || density > 1)
+        FATAL("bad density (above 0, up to 100)");
+      break;
+    case 'u':
+      novelty = atof(optarg) / 100;
+      if (novelty < 0 || novelty > 1)
+        FATAL("bad novelty (0 to 100)");
+      break;
+    case 'p':
+      for (pattern = 0; pattern < 3; pattern++)
+        if (!strcmp(optarg, pattern_names[pattern]))
+          break;
+      if (pattern == 3)
+        FATAL("unknown pattern '%s'", optarg);
+      break;
+    case 'P':
+      num_producers = atoi(optarg);
+      if (!num_producers || num_producers > PRODUCERS_MAX)
+        FATAL("bad number of producers (1 to %u)", PRODUCERS_MAX);
+      break;
+    case 'm':
+      if (num_modes == MODES_MAX)
+        FATAL("too many modes (up to %u)", MODES_MAX);
+      modes[num_modes++] = optarg;
+      break;
+    case 'd':
+      daemon_path = optarg;
+      break;
+    case 'w':
+      work_dir = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind < argc)
+    usage(argv[0]);
+}
+
+int main(int argc, char** argv) {
+  arg_parse(argc, argv);
+
+  struct lscov_chan_hdr* hdr = lscov_chan_attach();
+  if (hdr) {
+    producer_main(hdr);
+    return 0;
+  }
+
+  SAYF(cCYA "lscov-bench v" VERSION cRST "\n");
+
+  if (!num_modes) {
+    num_modes = sizeof(default_modes) / sizeof(default_modes[0]);
+    memcpy(modes, default_modes, sizeof(default_modes));
+  }
+
+  /* Ourselves, to be started by the daemon. */
+  char* self = realpath("/proc/self/exe", NULL);
+  if (!self)
+    PFATAL("cannot find ourselves");
+  argv[0] = self;
+
+  if (!daemon_path) {
+    char* path;
+    if (asprintf(&path, "%.*s/lscov-daemon", (int)(strrchr(self, '/') - self),
+          self) < 0)
+      PFATAL("asprintf() failed");
+    daemon_path = path;
+  }
+  if (access(daemon_path, X_OK))
+    PFATAL("cannot execute '%s'", daemon_path);
+
+  if (!work_dir) {
+    work_dir = strdup("/tmp/lscov-bench.XXXXXX");
+    if (!mkdtemp(work_dir))
+      PFATAL("mkdtemp() failed");
+  } else {
+    struct stat st;
+    if (mkdir(work_dir, 0700) && errno != EEXIST)
+      PFATAL("cannot create '%s'", work_dir);
+    if (stat(work_dir, &st) || !S_ISDIR(st.st_mode))
+      FATAL("'%s' is not a directory", work_dir);
+  }
+
+  ACTF("%lu executions per mode, %u KiB map, %g%% hit (%s), %g%% new, "
+      "%u producer(s)", num_execs, map_size >> 10, density * 100,
+      pattern_names[pattern], novelty * 100, num_producers);
+  ACTF("Daemon outputs in %s", work_dir);
+
+  SAYF("\n" cBRI "%-22s %10s %9s %8s %8s %8s %8s %9s %10s" cRST "\n",
+      "mode", "execs/s", "dropped", "wait50", "wait99", "ingest50",
+      "ingest99", "cpu/exec", "states");
+  for (u32 m = 0; m < num_modes; m++)
+    run_mode(m, argv);
+
+  SAYF("\n(latencies and CPU per execution in microseconds; ingest from the "
+      "daemon's last period)\n");
+  return 0;
+}
@@ -12,6 +12,8 @@
 #include <string>
 #include <unistd.h>
 
+#include "llvm/Config/llvm-config.h"
+
 int main(int argc, char** argv) {
   char** cc_params = (char**)malloc((argc + 128) * sizeof(char*));
   int cc_par_cnt = 1;
@@ -56,7 +58,8 @@ int main(int argc, char** argv) {
 
   std::string _libpath = std::string(basepath + "/libLSCovPass.so");
   std::string pass_plugin = "-fpass-plugin=" + _libpath;
-  std::string rt_obj = std::string(basepath + "/libLSCovRT.a");
+  std::string rt_obj = std::string(basepath + 
+      (getenv("LSCOV_THREADS") ? "/libLSCovRT-threads.a" : "/libLSCovRT.a"));
   //std::string rt_obj = std::string(basepath + "/CMakeFiles/LSCovRT.dir/lscov-llvm-rt.a.c.o");
 
   while (--argc) {
@@ -64,10 +67,30 @@ int main(int argc, char** argv) {
     cc_params[cc_par_cnt++] = cur;
   }
 
-  cc_params[cc_par_cnt++] = (char*)"-Xclang";
-  cc_params[cc_par_cnt++] = (char*)pass_plugin.c_str();
+  /* In LTO mode, the pass runs once on the whole program at link time
+   * instead of once per translation unit. */
+  std::string lto_plugin = "-Wl,--load-pass-plugin=" + _libpath;
+  bool lto = getenv("LSCOV_LTO");
+#if LLVM_VERSION_MAJOR < 15
+  /* The pass has no link-time hook before LLVM 15; the binary would come
+   * out uninstrumented. */
+  if (lto) {
+    std::cerr << "warning: LSCOV_LTO needs lscov built against LLVM 15+; "
+      "instrumenting per translation unit instead.\n";
+    lto = false;
+  }
+#endif
+  if (lto) {
+    cc_params[cc_par_cnt++] = (char*)"-flto";
+    cc_params[cc_par_cnt++] = (char*)"-fuse-ld=lld";
+    cc_params[cc_par_cnt++] = (char*)lto_plugin.c_str();
+  } else {
+    cc_params[cc_par_cnt++] = (char*)"-Xclang";
+    cc_params[cc_par_cnt++] = (char*)pass_plugin.c_str();
+  }
   cc_params[cc_par_cnt++] = (char*)rt_obj.c_str();
   cc_params[cc_par_cnt++] = (char*)"-lpthread";
+  cc_params[cc_par_cnt++] = (char*)"-ldl";
   cc_params[cc_par_cnt] = NULL;
 
   execvp(cc_params[0], (char**)cc_params);
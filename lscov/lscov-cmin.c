@@ -0,0 +1,570 @@
+/*
+ * lscov - corpus minimization
+ * ---------------------------
+ *
+ * Shrink a corpus without losing logic state coverage. Every input is run
+ * through the binary (built with lscov-clang, or with AFL++ and lscov both),
+ * and of all the inputs that produce the same logic state, only the smallest
+ * one is kept. afl-cmin, which keeps edge coverage, would drop most of them.
+ *
+ * With -r (relaxed), it keeps edge coverage instead, the way afl-cmin does,
+ * but over the bucketed branch indices that logic states are made of. For
+ * each index (and bucket), the smallest input that hits it is a candidate;
+ * going over the indices, a candidate is kept unless one kept earlier already
+ * covers the index.
+ *
+ * Workers (-T) run inputs in parallel, each with a channel of its own.
+ * Fingerprints are the daemon's, so they can be looked up in its event log.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stuff.h"
+#include "channel.h"
+#include "bucket.h"
+#include "hash.h"
+
+#define WORKERS_MAX       256
+
+/* Parameters */
+
+const char* in_dir = NULL;             // Corpus
+const char* out_dir = NULL;            // Minimized corpus
+u32         timeout_ms = 5000;         // Per input
+u32         num_workers = 0;           // Parallel runs (0: one per CPU)
+u8          relaxed = 0;               // Keep branch indices, not states?
+u8          keep_any = 0;              // Keep crashing/hanging inputs too?
+struct lscov_bucket* bucket = lscov_buckets;  // Bucketing scheme
+char**      target_argv = NULL;        // Binary command line ('@@': input)
+
+lscov_bucket_fn bucket_fn;
+
+/* Inputs, and what running them gave. */
+
+#define RUN_OK          0
+#define RUN_CRASH       1
+#define RUN_HANG        2
+#define RUN_UNMEASURED  3
+
+struct input {
+  char*       name;
+  u64         size;
+  u8          result;             // RUN_*
+  u64         fp;                 // Fingerprint (as the daemon's)
+  u32*        elems;              // Bucketed branch indices (-r)
+  u32         num_elems;          // index << 8 | bucket
+};
+
+struct input* inputs;
+u32         num_inputs;
+u32         next_input;           // Next to run (shared by workers)
+u32         num_done;
+
+
+/* Inputs */
+
+static int input_cmp_name(const void* _a, const void* _b) {
+  return strcmp(((const struct input *)_a)->name,
+      ((const struct input *)_b)->name);
+}
+
+static void inputs_load() {
+  DIR* dir = opendir(in_dir);
+  if (!dir)
+    PFATAL("cannot open '%s'", in_dir);
+
+  struct dirent* de;
+  u32 cap = 0;
+  while ((de = readdir(dir))) {
+    char* path;
+    struct stat st;
+    if (de->d_name[0] == '.')
+      continue;
+    if (asprintf(&path, "%s/%s", in_dir, de->d_name) < 0)
+      PFATAL("asprintf() failed");
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+      free(path);
+      continue;
+    }
+    free(path);
+
+    if (num_inputs == cap) {
+      cap = cap ? cap << 1 : 1024;
+      inputs = realloc(inputs, cap * sizeof(struct input));
+      if (!inputs)
+        PFATAL("input list allocation failed.");
+    }
+
+    memset(&inputs[num_inputs], 0, sizeof(struct input));
+    inputs[num_inputs].name = strdup(de->d_name);
+    inputs[num_inputs].size = st.st_size;
+    num_inputs++;
+  }
+  closedir(dir);
+
+  /* Same order every time, so ties go the same way too. */
+  qsort(inputs, num_inputs, sizeof(struct input), input_cmp_name);
+}
+
+
+/* Workers */
+
+struct worker {
+  struct lscov_chan chan;
+  char**      envp;               // Ours, with our LSCOV_CHANNEL
+  u8*         lstate;             // Bucketed map
+};
+
+static char** worker_envp(const char* chan_path) {
+  extern char** environ;
+  u32 n = 0;
+  while (environ[n])
+    n++;
+
+  char** envp = malloc((n + 2) * sizeof(char *));
+  u32 m = 0;
+  for (u32 i = 0; i < n; i++)
+    if (strncmp(environ[i], LSCOV_CHAN_ENV "=", strlen(LSCOV_CHAN_ENV) + 1))
+      envp[m++] = environ[i];
+  if (asprintf(&envp[m++], "%s=%s", LSCOV_CHAN_ENV, chan_path) < 0)
+    PFATAL("asprintf() failed");
+  envp[m] = NULL;
+
+  return envp;
+}
+
+static int wait_child(pid_t pid) {
+  /* Returns the status, or -1 if it took too long (and got killed). */
+  int status;
+  int ret = 0;
+
+#ifdef SYS_pidfd_open
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd >= 0) {
+    struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+      kill(pid, SIGKILL);
+      ret = -1;
+    }
+    close(pidfd);
+    waitpid(pid, &status, 0);
+    return ret ? ret : status;
+  }
+#endif
+
+  /* No pidfd: check every now and then. */
+  for (u64 waited_us = 0; waitpid(pid, &status, WNOHANG) != pid;
+      waited_us += 200) {
+    if (waited_us >= timeout_ms * 1000ULL) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      return -1;
+    }
+    usleep(200);
+  }
+
+  return status;
+}
+
+static void run_input(struct worker* w, struct input* in) {
+  char* path;
+  if (asprintf(&path, "%s/%s", in_dir, in->name) < 0)
+    PFATAL("asprintf() failed");
+
+  /* The command line, with the input in place of '@@' (or as stdin). */
+  u32 argc = 0;
+  u8 file_arg = 0;
+  while (target_argv[argc])
+    argc++;
+  char* argv[argc + 1];
+  for (u32 i = 0; i <= argc; i++) {
+    argv[i] = target_argv[i];
+    if (argv[i] && !strcmp(argv[i], "@@")) {
+      argv[i] = path;
+      file_arg = 1;
+    }
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+    PFATAL("fork() for the binary failed");
+
+  if (!pid) {
+    int null_fd = open("/dev/null", O_RDWR);
+    int in_fd = file_arg ? null_fd : open(path, O_RDONLY);
+    dup2(in_fd < 0 ? null_fd : in_fd, 0);
+    dup2(null_fd, 1);
+    dup2(null_fd, 2);
+    execvpe(argv[0], argv, w->envp);
+    _exit(127);
+  }
+
+  int status = wait_child(pid);
+  free(path);
+
+  struct lscov_chan_hdr* hdr = w->chan.hdr;
+  struct lscov_chan_slot* slot = lscov_chan_slot(hdr, 0);
+  u32 state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+  if (state == LSCOV_SLOT_FREE || !hdr->map_size) {
+    in->result = RUN_UNMEASURED;
+  } else {
+    /* Still busy: killed on the timeout, or died before it could tell. */
+    if (status < 0)
+      in->result = RUN_HANG;
+    else if (state == LSCOV_SLOT_BUSY || !WIFEXITED(status) ||
+        state - LSCOV_SLOT_READY != LSCOV_EXEC_OK)
+      in->result = RUN_CRASH;
+    else
+      in->result = RUN_OK;
+
+    /* The logic state, and its fingerprint, as the daemon would take them. */
+    u32 size = hdr->map_size;
+    if (!bucket->num_steps)
+      memcpy(w->lstate, lscov_chan_map(hdr, 0), size);
+    else
+      bucket_fn(bucket, w->lstate, lscov_chan_map(hdr, 0), size);
+
+    in->fp = ((u64)lscov_hash_murmur3(w->lstate, size, 0) << 32) |
+      lscov_hash_murmur3(w->lstate, size, 1);
+
+    if (relaxed) {
+      u32 n = 0;
+      for (u32 i = 0; i < size; i++)
+        n += !!w->lstate[i];
+
+      in->elems = malloc((n ? n : 1) * sizeof(u32));
+      for (u32 i = 0; i < size; i++)
+        if (w->lstate[i])
+          in->elems[in->num_elems++] = i << 8 | w->lstate[i];
+    }
+  }
+
+  /* Nobody else uses the slot; just take it back. */
+  slot->producer = 0;
+  __atomic_store_n(&slot->state, LSCOV_SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+static void* worker_main(void* _unused) {
+  struct worker w;
+  lscov_chan_create(&w.chan, NULL, LSTATE_SIZE_MAX, 1, 0, 1);
+  w.envp = worker_envp(w.chan.path);
+  w.lstate = malloc(LSTATE_SIZE_MAX);
+  if (!w.lstate)
+    PFATAL("logic state allocation failed.");
+
+  while (1) {
+    u32 i = __atomic_fetch_add(&next_input, 1, __ATOMIC_RELAXED);
+    if (i >= num_inputs)
+      break;
+
+    run_input(&w, &inputs[i]);
+    __atomic_fetch_add(&num_done, 1, __ATOMIC_RELAXED);
+  }
+
+  lscov_chan_destroy(&w.chan);
+  free(w.lstate);
+  return NULL;
+}
+
+static void run_all() {
+  pthread_t workers[WORKERS_MAX];
+  for (u32 i = 0; i < num_workers; i++)
+    if (pthread_create(&workers[i], NULL, worker_main, NULL))
+      PFATAL("pthread_create() failed");
+
+  /* Progress, until the workers are through. */
+  while (__atomic_load_n(&num_done, __ATOMIC_RELAXED) < num_inputs) {
+    SAYF("\r    Processing %u/%u...", num_done, num_inputs);
+    fflush(stdout);
+    usleep(100000);
+  }
+  SAYF("\r    Processing %u/%u... done.\n", num_done, num_inputs);
+
+  for (u32 i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+}
+
+
+/* Minimization */
+
+static u8 input_keepable(const struct input* in) {
+  return in->result == RUN_OK ||
+    (keep_any && (in->result == RUN_CRASH || in->result == RUN_HANG));
+}
+
+static int input_smaller(const struct input* a, const struct input* b) {
+  /* Smaller, or as small and first by name. */
+  return a->size < b->size || (a->size == b->size && a < b);
+}
+
+static int input_cmp_fp(const void* _a, const void* _b) {
+  const struct input *a = *(struct input **)_a, *b = *(struct input **)_b;
+  if (a->fp != b->fp)
+    return a->fp < b->fp ? -1 : 1;
+  return input_smaller(a, b) ? -1 : input_smaller(b, a);
+}
+
+static u32 minimize_strict(u8* keep) {
+  /* One smallest input per logic state. */
+  struct input** by_fp = malloc(num_inputs * sizeof(struct input *));
+  u32 n = 0;
+  for (u32 i = 0; i < num_inputs; i++)
+    if (input_keepable(&inputs[i]))
+      by_fp[n++] = &inputs[i];
+
+  qsort(by_fp, n, sizeof(struct input *), input_cmp_fp);
+
+  u32 num_states = 0;
+  for (u32 i = 0; i < n; i++) {
+    if (!i || by_fp[i]->fp != by_fp[i - 1]->fp) {
+      keep[by_fp[i] - inputs] = 1;
+      num_states++;
+    }
+  }
+
+  free(by_fp);
+  return num_states;
+}
+
+/* Element (bucketed branch index) to its smallest input: open addressing,
+ * grown at half full. */
+
+struct elem_slot {
+  u32         elem;
+  u32         input;              // + 1 (0: empty slot)
+};
+
+static struct elem_slot* elem_table;
+static u32 elem_table_size, elem_table_used;
+
+static struct elem_slot* elem_find(u32 elem) {
+  u32 mask = elem_table_size - 1;
+  u32 i = (elem * 0x9e3779b1) & mask;
+  while (elem_table[i].input && elem_table[i].elem != elem)
+    i = (i + 1) & mask;
+  return &elem_table[i];
+}
+
+static void elem_grow() {
+  struct elem_slot* old = elem_table;
+  u32 old_size = elem_table_size;
+
+  elem_table_size = old_size ? old_size << 1 : 1 << 16;
+  elem_table = calloc(elem_table_size, sizeof(struct elem_slot));
+  if (!elem_table)
+    PFATAL("element table allocation failed.");
+
+  for (u32 i = 0; i < old_size; i++)
+    if (old[i].input)
+      *elem_find(old[i].elem) = old[i];
+  free(old);
+}
+
+static int elem_slot_cmp(const void* _a, const void* _b) {
+  u32 a = ((const struct elem_slot *)_a)->elem;
+  u32 b = ((const struct elem_slot *)_b)->elem;
+  return a < b ? -1 : a > b;
+}
+
+static u32 minimize_relaxed(u8* keep) {
+  /* The smallest input of every element. */
+  elem_grow();
+  for (u32 i = 0; i < num_inputs; i++) {
+    struct input* in = &inputs[i];
+    if (!input_keepable(in))
+      continue;
+
+    for (u32 e = 0; e < in->num_elems; e++) {
+      struct elem_slot* s = elem_find(in->elems[e]);
+      if (!s->input) {
+        s->elem = in->elems[e];
+        s->input = i + 1;
+        if (++elem_table_used * 2 > elem_table_size)
+          elem_grow();
+      } else if (input_smaller(in, &inputs[s->input - 1])) {
+        s->input = i + 1;
+      }
+    }
+  }
+
+  /* Over the elements in order: keep the candidate unless the element's
+   * already covered by a kept one. */
+  u32 n = 0;
+  for (u32 i = 0; i < elem_table_size; i++)
+    if (elem_table[i].input)
+      elem_table[n++] = elem_table[i];
+  qsort(elem_table, n, sizeof(struct elem_slot), elem_slot_cmp);
+
+  /* Covered elements, found by binary search in the sorted ones. */
+  u8* done = calloc(n, 1);
+  for (u32 i = 0; i < n; i++) {
+    if (done[i])
+      continue;
+
+    struct input* in = &inputs[elem_table[i].input - 1];
+    keep[in - inputs] = 1;
+
+    for (u32 e = 0; e < in->num_elems; e++) {
+      struct elem_slot key = { in->elems[e], 0 };
+      struct elem_slot* s = bsearch(&key, elem_table, n,
+          sizeof(struct elem_slot), elem_slot_cmp);
+      if (s)
+        done[s - elem_table] = 1;
+    }
+  }
+
+  free(done);
+  return n;
+}
+
+static void copy_input(const struct input* in) {
+  char *src, *dst;
+  if (asprintf(&src, "%s/%s", in_dir, in->name) < 0 ||
+      asprintf(&dst, "%s/%s", out_dir, in->name) < 0)
+    PFATAL("asprintf() failed");
+
+  /* A hard link if we can, a copy otherwise. */
+  if (link(src, dst)) {
+    int in_fd = open(src, O_RDONLY);
+    int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (in_fd < 0 || out_fd < 0)
+      PFATAL("cannot copy '%s' to '%s'", src, dst);
+
+    char buf[65536];
+    ssize_t len;
+    while ((len = read(in_fd, buf, sizeof(buf))) > 0)
+      if (write(out_fd, buf, len) != len)
+        PFATAL("cannot write '%s'", dst);
+
+    close(in_fd);
+    close(out_fd);
+  }
+
+  free(src);
+  free(dst);
+}
+
+
+static void usage(const char* argv0) {
+  SAYF("Usage: %s -i <dir> -o <dir> [options] -- <binary> [args...]\n\n"
+       "    -i <dir>       corpus\n"
+       "    -o <dir>       minimized corpus (created; must not exist)\n"
+       "    -T <workers>   parallel runs (default: one per CPU)\n"
+       "    -t <ms>        timeout per input (default: %u)\n"
+       "    -b <scheme>    bucketing (default: %s)\n"
+       "    -r             relaxed: keep bucketed branch indices, not logic "
+       "states\n"
+       "    -A             keep crashing and hanging inputs too\n\n"
+       "'@@' in the arguments is replaced by the input; otherwise it's "
+       "stdin.\n", argv0, timeout_ms, bucket->name);
+  exit(1);
+}
+
+void arg_parse(int argc, char** argv) {
+  int c;
+  while ((c = getopt(argc, argv, "+i:o:T:t:b:rA")) != -1) {
+    switch (c) {
+    case 'i':
+      in_dir = optarg;
+      break;
+    case 'o':
+      out_dir = optarg;
+      break;
+    case 'T':
+      num_workers = atoi(optarg);
+      if (!num_workers || num_workers > WORKERS_MAX)
+        FATAL("bad number of workers (1 to %u)", WORKERS_MAX);
+      break;
+    case 't':
+      timeout_ms = atoi(optarg);
+      if (!timeout_ms)
+        FATAL("bad timeout");
+      break;
+    case 'b':
+      bucket = lscov_bucket_find(optarg);
+      if (!bucket)
+        FATAL("unknown bucketing scheme '%s'", optarg);
+      break;
+    case 'r':
+      relaxed = 1;
+      break;
+    case 'A':
+      keep_any = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (!in_dir || !out_dir || optind >= argc)
+    usage(argv[0]);
+  target_argv = argv + optind;
+
+  if (!num_workers) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cpus < 1 ? 1 : cpus > WORKERS_MAX ? WORKERS_MAX : cpus;
+  }
+}
+
+int main(int argc, char** argv) {
+  SAYF(cCYA "lscov-cmin v" VERSION cRST "\n");
+  arg_parse(argc, argv);
+
+  const char* kernel;
+  lscov_bucket_init(bucket);
+  bucket_fn = lscov_bucket_select(&kernel);
+
+  inputs_load();
+  if (!num_inputs)
+    FATAL("no inputs in '%s'", in_dir);
+  if (mkdir(out_dir, 0700))
+    PFATAL("cannot create '%s'", out_dir);
+
+  ACTF("Running %u input(s), %u worker(s), %s bucketing...", num_inputs,
+      num_workers, bucket->name);
+  run_all();
+
+  u32 counts[4] = { 0 };
+  for (u32 i = 0; i < num_inputs; i++)
+    counts[inputs[i].result]++;
+  if (counts[RUN_UNMEASURED] == num_inputs)
+    FATAL("no input got measured; is '%s' built with lscov?", target_argv[0]);
+  if (counts[RUN_UNMEASURED])
+    WARNF("%u input(s) ran unmeasured.", counts[RUN_UNMEASURED]);
+  if (counts[RUN_CRASH] || counts[RUN_HANG])
+    WARNF("%u input(s) crashed, %u hung (%s).", counts[RUN_CRASH],
+        counts[RUN_HANG], keep_any ? "kept if needed" : "left out");
+
+  u8* keep = calloc(num_inputs, 1);
+  u32 covered = relaxed ? minimize_relaxed(keep) : minimize_strict(keep);
+
+  u32 num_kept = 0;
+  u64 size_before = 0, size_after = 0;
+  for (u32 i = 0; i < num_inputs; i++) {
+    size_before += inputs[i].size;
+    if (keep[i]) {
+      copy_input(&inputs[i]);
+      num_kept++;
+      size_after += inputs[i].size;
+    }
+  }
+
+  OKF("%u distinct %s; kept %u of %u input(s) (%'lu of %'lu bytes) in %s",
+      covered, relaxed ? "branch indices (bucketed)" : "logic states",
+      num_kept, num_inputs, size_after, size_before, out_dir);
+  return 0;
+}
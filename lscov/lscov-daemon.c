@@ -9,24 +9,34 @@
  */
 
 #define USE_COLOR     // Yes, please.
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
 
 #include <assert.h>
 #include <fcntl.h>
 #include <locale.h>
 #include <math.h>
+#include <netinet/in.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
-#include <sys/ipc.h>
 #include <sys/mman.h>
-#include <sys/shm.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "stuff.h"
+#include "channel.h"
+#include "bucket.h"
+#include "series.h"
+#include "evlog.h"
+#include "hist.h"
+#include "hash.h"
 #include "emoji.h"
 
 /* Parameters */
@@ -35,264 +45,442 @@ time_t      tallying_period = 10;      // Tallying period (in seconds)
 u32         bfilter_size = 0x4000000;  // Bloom filter size, in bytes
 u8          num_hashes = 4;            // Number of hashes
 const char* out_path = "lscov.csv";    // Output path
-u8          error_percent = 0;         // Error bound (0: disabled)
+u8          error_percent = 0;         // Bounds' error rate, % (0: none)
+double      error_z = 0;               // ... as a z-score (bfilter_calc_z())
+u8          sbf_mode = 0;              // Grow the filter as it fills up?
+long        reap_period_ms = 50;       // Producer liveness check period
+const char* chan_name = NULL;          // Channel SHM name (NULL: memfd)
+u32         chan_flags = 0;            // Channel flags (LSCOV_CHAN_*)
+u32         num_slots = 0;             // Slots (0: 1, or 4 if non-blocking)
+u32         sample_rate = 1;           // Measure one execution in this many
+u8          thread_mode = 0;           // Per-thread maps (THREADS_*)
+char**      target_argv = NULL;        // Fuzzer command line (NULL: none)
+struct lscov_bucket* bucket = lscov_buckets;  // Bucketing scheme
+char*       view_specs = NULL;         // Extra views (NULL: none)
+u32         cms_size_kb = 0;           // Frequency sketch size (0: disabled)
+double      stop_pnew = 0;             // Stop below this P(new) (0: never)
+u32         topk_size = 0;             // Heavy hitters to follow (0: none)
+u8          topk_out = 0;              // Dump them to 'out_path'.top? (-k)
+u8          evlog_mode = 0;            // Log every logic state measured?
+const char* ctl_path = NULL;           // Control socket path (NULL: none)
+const char* metrics_spec = NULL;       // Metrics port or file (NULL: none)
+u8          latency_mode = 0;          // Report latencies in the output?
+
+/* Per-thread maps: off (threads share a map), one logic state per thread, or
+ * one logic state out of the union of all threads' maps. */
+
+#define THREADS_SHARED  0
+#define THREADS_PER     1
+#define THREADS_UNION   2
+
+/* Views: what to make of a hit count map, each counted on its own. The first
+ * one is the logic state under '-b', counted in 'bfilter' as always. Edges
+ * are (edge, bucket) pairs, told apart by bits as in AFL's virgin map; the
+ * plain edge view is the same under the '1' bucketing. */
+
+#define VIEW_LSTATE     0   // Logic states (Bloom filter, estimated)
+#define VIEW_BEDGE      1   // Bucketed edges (union of maps, exact)
+
+#define VIEWS_MAX       8
+
+struct lscov_view {
+  char        name[32];           // As given with -v
+  u8          kind;               // VIEW_*
+  struct lscov_bucket* bucket;    // Bucketing scheme
+  u8*         lstate;             // Bucketed map of the current execution
+  u8          shares_lstate;      // Bucketed by an earlier view already?
+  u8*         bits;               // Bloom filter or union of bucketed maps
+  u64         fp;                 // Fingerprint of 'lstate' (logic states)
+};
+
+/* Frequencies: a count-min sketch with conservative update, keyed by the
+ * fingerprint of the primary logic state. A fingerprint picks one cache line,
+ * split into CMS_DEPTH rows of their own, and one counter in each row, so an
+ * update costs a single miss and no two rows share a counter. */
+
+#define CMS_DEPTH       4
+#define CMS_LINE        16    // Counters per (64-byte) cache line
+#define CMS_ROW         (CMS_LINE / CMS_DEPTH)
+#define CMS_SIZE_KB     4096  // Default size, if only the estimates need it
+
+/* Heavy hitters: Space-Saving over the same fingerprints. Entries stay
+ * sorted by count, and entries of the same count form a group (a range of
+ * positions), so bumping one is a swap to the front of its group: O(1). The
+ * branch indices of a logic state are taken once it recurs while followed. */
+
+#define TOPK_INDICES    32    // Branch indices kept per heavy hitter
+#define TOPK_SHARE      10    // Heavy hitters making up 'Top10(%)'
+#define TOPK_SIZE       64    // Default count, if only 'Top10(%)' needs them
+
+struct topk_entry {
+  u64         fp;                 // Fingerprint
+  u32         count;              // Frequency, overestimated by...
+  u32         error;              // ... at most this much
+  u32         group;              // Group of the entries with this count
+  u32         num_indices;        // Branch indices (hit) of the logic state
+  u32         indices[TOPK_INDICES];
+};
+
+struct topk_group {
+  u32         start;              // First position in 'topk_order'
+  u32         end;                // Last position
+};
+
+/* Producers: counters per producer PID, for the control socket. The least
+ * recently seen one makes room for a new one (with a fork server, every
+ * execution is a producer of its own). */
+
+#define PRODUCERS_MAX   64
+
+struct producer {
+  pid_t       pid;                // 0: unused
+  u32         execs;
+  u32         crashes;
+  u32         hangs;
+  u32         new_states;         // New logic states found (primary)
+  u32         last_seen;          // 'exec_count' as of the last execution
+};
+
+/* Scalable Bloom filter (Almeida et al., 2007): once the current filter is
+ * half full, add one twice as large with one more hash, keeping the overall
+ * false positive rate bounded. A logic state goes to the latest filter unless
+ * an earlier one has it. The hashes are derived from the fingerprint (double
+ * hashing), so more of them cost no more passes over the logic state. */
+
+#define SBF_SIZE_INIT   (1 << 20)   // Initial size (unless -m), in bytes
+#define SBF_SIZE_MAX    (1 << 28)   // Don't grow stages any further
+#define SBF_STAGES_MAX  16
+#define SBF_FILL_MAX    0.5         // Add a stage at this fill ratio
+
+struct sbf_stage {
+  u8*         bits;
+  u32         size;               // In bytes
+  u32         size_bits;
+  u8          num_hashes;
+  u32         num_1s;             // Counted as they're set
+};
+
+/* Event log: every logic state measured goes to a ring, from which a thread
+ * of its own packs them into blocks (see evlog.h) and writes them out. The
+ * loop never waits for it; events that find the ring full are dropped. */
+
+#define EVLOG_RING_SIZE (1 << 16)   // Events in flight, at most (power of 2)
+#define EVLOG_FLUSH_MS  100         // Write a partial block after this long
+#define EVLOG_POLL_US   1000        // Writer's sleep when there's little to do
 
 /* State variables */
 
-s32         shm_hcount_id;        // (SHM) ID for 'hit_count'
-u8*         hit_counts;           // (SHM) Branch hit counts
-sem_t*      sema_rd;              // (sema) RT to daemon - "que update"
-sem_t*      sema_dr;              // (sema) daemon to RT - "que execution"
-struct timespec loop_timeout;     // 'sema_rd' semaphore timeout
+struct lscov_chan chan;           // (SHM) Channel to the binary
+u32         seq_read;             // 'seq_done' as of the last slot scan
+time_t      last_ready_time;      // When a slot was last ready
+u32         lstate_size;          // Logic state size, told by the binary
+pid_t       target_pid;           // Fuzzer spawned by us (0: none)
+struct timespec loop_timeout;     // 'seq_done' wait timeout
+lscov_bucket_fn bucket_fn;        // Bucketing kernel for this CPU
 
 u8*         bfilter;              // Bloom filter itself
 u32         bfilter_size_bits;    // Bloom filter size, in bits
+struct sbf_stage sbf[SBF_STAGES_MAX];  // Scalable filter stages
+u32         sbf_num_stages;
+u32         sbf_size_init = SBF_SIZE_INIT;  // First stage, in bytes
+struct lscov_view views[VIEWS_MAX];  // Views (0: the primary logic state)
+u32         num_views;
 time_t      start_time;           // Measurement start time (in unix time)
 time_t      next_tallying_time;   // Next tallying time (in unix time)
+time_t      tally_base_time;      // Tallies are periods apart from this
+time_t      last_tally_time;      // Time of the last row (in unix time)
+time_t      new_period;           // Tallying period from the next tally on
 
 u32         exec_count;
 u32         exec_count_in_period;
+u32         crash_count;          // Executions that caught a fatal signal
+u64         slot_execs[LSCOV_SLOTS_MAX];  // Executions read, per slot
+struct producer producers[PRODUCERS_MAX];
+u32         last_producer;        // Where the last execution's producer is
+u32         hang_count;           // Executions that died silently
 u8          stop_soon;
-
+u8          saturated;            // P(new) fell below 'stop_pnew'
+volatile sig_atomic_t dump_soon;  // SIGUSR1 came in (see lscov_loop())
+volatile sig_atomic_t stop_asked; // SIGINT and co., or the fuzzer's gone
+
+/* Where the last row left off. Rows come from report threads, the control
+ * socket, and the final one, so one at a time. */
+pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+u32         prev_cov;
+u32         prev_exec_count;
+u64         prev_total;
+u32         prev_prev_time;
+
+/* The last row's estimates, for metrics (counting the filter's 1s at every
+ * scrape would cost as much as a tally). */
+pthread_mutex_t tally_lock = PTHREAD_MUTEX_INITIALIZER;
+u32         tally_cov;
+u32         tally_lower;
+u32         tally_upper;
+float       tally_density;
+
+u32*        cms;                  // Count-min sketch (NULL: disabled)
+u32         cms_num_lines;        // Sketch size, in cache lines
+u64         cms_total;            // Logic states counted
+u32         cms_freq[3];          // States seen once and twice (estimated)
+
+struct topk_entry* topk;          // Heavy hitters (NULL: disabled)
+u32*        topk_order;           // Entries by count, descending
+u32*        topk_pos;             // Position of each entry in 'topk_order'
+struct topk_group* topk_groups;
+u32*        topk_free_groups;     // Unused groups (stack)
+u32         topk_num_free_groups;
+u32*        topk_hash;            // Fingerprint -> entry + 1 (0: empty)
+u32         topk_hash_size;       // Power of 2, at least twice 'topk_size'
+u64         topk_total;           // Logic states counted
+pthread_mutex_t topk_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+char*       top_path;             // Heavy hitter dumps (NULL: not asked)
+
+struct lscov_event* evlog_ring;   // Events not written yet (NULL: disabled)
+u64         evlog_head;           // Next event to push (loop)
+u64         evlog_tail;           // Next event to write (writer)
+u64         evlog_dropped;        // Events that found the ring full
+u8          evlog_stop_soon;
+pthread_t   evlog_writer;
+FILE*       evlog_file;           // 'out_path'.ev
+u64         evlog_start_ns;       // (lscov_now_ns()) Event times start here
+char*       evlog_path;
+
+int         ctl_fd = -1;          // Control socket (listening)
+pthread_t   ctl_thread;
+
+u8          timing_on;            // Time executions (-L or -M)
+u8          metrics_on;
+u16         metrics_port;         // Serve on localhost (0: write a file)
+int         metrics_fd = -1;      // (listening)
+char*       metrics_tmp_path;     // Written, then renamed to the file
+pthread_t   metrics_thread;
+struct lscov_hist ingest_hist;    // From a slot ready to done with it
+struct lscov_hist wait_hist;      // Waiting for a slot to get ready
+struct lscov_hist prev_rt_wait;   // As of the last row (-L)
+struct lscov_hist prev_ingest;
+
+FILE*       out_csv;              // 'out_path'
+FILE*       out_series;           // Binary twin ('out_path'.ts)
+char*       series_path;
+struct lscov_series_field out_fields[LSCOV_SERIES_FIELDS_MAX];  // Columns
+u32         out_num_fields;
+
+
+static void out_add_field(const char* name, u32 type, u32 digits) {
+  struct lscov_series_field* f = &out_fields[out_num_fields++];
+  snprintf(f->name, sizeof(f->name), "%s", name);
+  f->type = type;
+  f->digits = digits;
+}
 
 void out_init() {
-  FILE *fout = fopen(out_path, "w");
-
-  fprintf(fout, "Time,Coverage");
-  if (error_percent > 0)
-    fprintf(fout, ",(Lower),(Upper)");
-  fprintf(fout, ",Density,RateS(ins),RateE(per),RateS(avg),RateE(avg)\n");
+  /* Columns, in order. Which of them are there depends on the options. */
+  char name[48];
+  out_add_field("Time", LSCOV_SERIES_U64, 0);
+  out_add_field("Coverage", LSCOV_SERIES_U64, 0);
+  if (error_percent > 0) {
+    out_add_field("(Lower)", LSCOV_SERIES_U64, 0);
+    out_add_field("(Upper)", LSCOV_SERIES_U64, 0);
+  }
+  out_add_field("Density", LSCOV_SERIES_F64, 2);
+  out_add_field("RateS(ins)", LSCOV_SERIES_U64, 0);
+  out_add_field("RateE(per)", LSCOV_SERIES_F64, 2);
+  out_add_field("RateS(avg)", LSCOV_SERIES_U64, 0);
+  out_add_field("RateE(avg)", LSCOV_SERIES_F64, 2);
+  out_add_field("Execs", LSCOV_SERIES_U64, 0);
+  out_add_field("Crashes", LSCOV_SERIES_U64, 0);
+  out_add_field("Hangs", LSCOV_SERIES_U64, 0);
+  out_add_field("Total", LSCOV_SERIES_U64, 0);
+  out_add_field("Dropped", LSCOV_SERIES_U64, 0);
+  out_add_field("RateS(ext)", LSCOV_SERIES_U64, 0);
+  if (topk) {
+    snprintf(name, sizeof(name), "Top%u(%%)", 
+        topk_size < TOPK_SHARE ? topk_size : TOPK_SHARE);
+    out_add_field(name, LSCOV_SERIES_F64, 2);
+  }
+  if (cms) {
+    out_add_field("Singletons", LSCOV_SERIES_U64, 0);
+    out_add_field("Doubletons", LSCOV_SERIES_U64, 0);
+    out_add_field("Chao1", LSCOV_SERIES_U64, 0);
+    out_add_field("PNew", LSCOV_SERIES_F64, LSCOV_SERIES_AUTO);
+  }
+  for (u32 i = 1; i < num_views; i++) {
+    snprintf(name, sizeof(name), "Coverage(%s)", views[i].name);
+    out_add_field(name, LSCOV_SERIES_U64, 0);
+  }
+  if (latency_mode) {
+    out_add_field("WaitP50(us)", LSCOV_SERIES_F64, 2);
+    out_add_field("WaitP99(us)", LSCOV_SERIES_F64, 2);
+    out_add_field("IngestP50(us)", LSCOV_SERIES_F64, 2);
+    out_add_field("IngestP99(us)", LSCOV_SERIES_F64, 2);
+  }
 
-  fclose(fout);
+  /* Both files stay open; a row costs a write (each) when flushed. */
+  if (asprintf(&series_path, "%s.ts", out_path) < 0)
+    PFATAL("asprintf() failed.");
+
+  out_csv = fopen(out_path, "w");
+  if (!out_csv)
+    PFATAL("cannot open '%s'", out_path);
+  out_series = fopen(series_path, "w");
+  if (!out_series)
+    PFATAL("cannot open '%s'", series_path);
+
+  lscov_series_print_header(out_csv, out_fields, out_num_fields);
+
+  u32 hdr_size = lscov_series_hdr_size(out_num_fields);
+  struct lscov_series_hdr* hdr = calloc(1, hdr_size);
+  memcpy(hdr->magic, LSCOV_SERIES_MAGIC, sizeof(hdr->magic));
+  hdr->version = LSCOV_SERIES_VERSION;
+  hdr->hdr_size = hdr_size;
+  hdr->num_fields = out_num_fields;
+  hdr->record_size = out_num_fields * sizeof(union lscov_series_value);
+  memcpy(hdr->fields, out_fields, 
+      out_num_fields * sizeof(struct lscov_series_field));
+  fwrite(hdr, hdr_size, 1, out_series);
+  free(hdr);
+
+  fflush(out_csv);
+  fflush(out_series);
 }
 
-void out_append(u32 time, u32 cov, u32 lower_err, u32 upper_err, float density,
-    u32 rate_ins, float rate_per, u32 rate_avg, float rate_per_avg) {
-  FILE *fout = fopen(out_path, "a");
+void out_append(const union lscov_series_value* row, u32 num_values) {
+  /* Reports may overlap (e.g., the last one); keep their rows in one piece. */
+  if (num_values != out_num_fields)
+    FATAL("bogus number of values (%u, not %u)", num_values, out_num_fields);
 
-  fprintf(fout, "%u,%u", time, cov);
-  if (error_percent > 0)
-    fprintf(fout, ",%u,%u", lower_err, upper_err);
-  fprintf(fout, ",%u,%u,%3.2f,%u,%3.2f,%u,%3.2f\n", time, cov, density,
-      rate_ins, rate_per, rate_avg, rate_per_avg);
+  flockfile(out_csv);
+  lscov_series_print_record(out_csv, out_fields, out_num_fields, row);
+  fflush(out_csv);
+  funlockfile(out_csv);
 
-  fclose(fout);
+  flockfile(out_series);
+  fwrite(row, sizeof(union lscov_series_value), num_values, out_series);
+  fflush(out_series);
+  funlockfile(out_series);
 }
 
 
-static inline int hcount_wait_until_ready() {
-  int _sema_rd_val;
-  sem_getvalue(sema_rd, &_sema_rd_val);
-  if (_sema_rd_val > 1) {
-    assert(0 && "_sema_rd_val > 1");
-    FATAL("_sema_rd_val: %d", _sema_rd_val);
+static u32 hcount_reap() {
+  /* Executions that died without finalizing: finalize them for their
+   * producers, unless they (or the next execution) got there first. */
+  struct lscov_chan_hdr* hdr = chan.hdr;
+  u32 num_reaped = 0;
+
+  for (u32 s = 0; s < hdr->num_slots; s++) {
+    struct lscov_chan_slot* slot = lscov_chan_slot(hdr, s);
+    pid_t producer = __atomic_load_n(&slot->producer, __ATOMIC_ACQUIRE);
+    u32 busy = LSCOV_SLOT_BUSY;
+
+    if (slot->state == LSCOV_SLOT_BUSY && producer &&
+        lscov_pid_dead(producer) &&
+        __atomic_compare_exchange_n(&slot->state, &busy, 
+          LSCOV_SLOT_READY + LSCOV_EXEC_HANG, 0, __ATOMIC_SEQ_CST, 
+          __ATOMIC_RELAXED))
+      num_reaped++;
   }
-  //return sem_timedwait(sema_rd, &loop_timeout);
-  return sem_wait(sema_rd);
-}
 
-/* Bucketing excerpted from AFL. It was much faster than my implementation,
- * unsurprisingly */
+  return num_reaped;
+}
 
-#ifdef LSCOV_BUCKET
-#ifdef BUCKET_1
-static const u8 count_bucket_lookup8[256] = {
-  [0]           = 0,
-  [1 ... 255]   = 1,
-};
-#elif defined BUCKET_LOG2_LOG3p2
-static const u8 count_bucket_lookup8[256] = {
-  [0]           = 0,    // No hit
-  [1 ... 8]     = 1,    // Hit
-  [9 ... 255]   = 2,    // Repetition
-};
-#elif defined BUCKET_LOG2_LOG4p1_p1
-static const u8 count_bucket_lookup8[256] = {
-  [0]           = 0,    // No hit
-  [1 ... 3]     = 1,    // Hit
-  [4 ... 63]    = 2,    // Revisit
-  [64 ... 255]  = 4,    // Repetition
-};
-#else // BUCKET_LOG2
-static const u8 count_bucket_lookup8[256] = {
-  [0]           = 0,    // No hit
-  [1]           = 1,    // Hit
-  [2 ... 3]     = 2,    
-  [4 ... 7]     = 4,    
-  [8 ... 15]    = 8,    
-  [16 ... 31]   = 16,    
-  [32 ... 63]   = 32,    
-  [64 ... 127]  = 64,   // Repetition
-  [128 ... 255] = 128,
-};
-#endif
+static inline int hcount_wait_until_ready() {
+  /* Wait until some slot gets ready, or the next tallying time. */
+  struct lscov_chan_hdr* hdr = chan.hdr;
+
+  while (__atomic_load_n(&hdr->seq_done, __ATOMIC_ACQUIRE) == seq_read) {
+    /* While executions are (or may soon be) in flight, wake up every now and
+     * then to see if their processes are still there. Only a fuzzer that's
+     * been quiet for a whole period lets us sleep until the next tally. */
+    u8 in_flight = time(NULL) - last_ready_time < tallying_period;
+    for (u32 s = 0; s < hdr->num_slots; s++)
+      if (lscov_chan_slot(hdr, s)->state == LSCOV_SLOT_BUSY)
+        in_flight = 1;
+
+    struct timespec deadline = loop_timeout;
+    if (in_flight) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += reap_period_ms * 1000000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      if (deadline.tv_sec >= loop_timeout.tv_sec)
+        deadline = loop_timeout;
+    }
 
-static u16 count_bucket_lookup16[65536];
-#endif
+    if (!lscov_chan_wait(&hdr->seq_done, seq_read, &hdr->d_sleeping, 
+          &hdr->d_spins, &deadline))
+      break;
 
-static inline void hcount_bucket_to_lstate(u8* lstate) {
-#ifdef LSCOV_BUCKET
-  u32 i = LSTATE_SIZE >> 3;
-  u64 *mem = (u64 *)hit_counts;
-  u64 *dest = (u64 *)lstate;
-
-  while (i--) {
-    /* Optimize for sparse bitmaps. */
-
-    if (unlikely(*mem)) {
-      u16* mem16 = (u16*)mem;
-      u16* dest16 = (u16*)dest;
-      dest16[0] = count_bucket_lookup16[mem16[0]];
-      dest16[1] = count_bucket_lookup16[mem16[1]];
-      dest16[2] = count_bucket_lookup16[mem16[2]];
-      dest16[3] = count_bucket_lookup16[mem16[3]];
-    } else {
-      *dest = 0;
+    if (in_flight && hcount_reap()) {
+      last_ready_time = time(NULL);
+      return 0;
     }
 
-    mem++;
-    dest++;
+    if (time(NULL) >= loop_timeout.tv_sec || dump_soon || stop_asked)
+      return -1;
   }
-#else
-  /* It feels wasteful as 7/8 of the bits are 0, but it may be better than
-   * compacting bits as it requires two additional operations (i.e., load and
-   * shift) during execution. I need to check which is better soon tho. */ 
 
-  memcpy(lstate, hit_counts, LSTATE_SIZE);
-#endif
+  seq_read = __atomic_load_n(&hdr->seq_done, __ATOMIC_ACQUIRE);
+  last_ready_time = time(NULL);
+  return 0;
 }
 
-void hcount_mark_read() {
-  int _sema_dr_val;
-  sem_getvalue(sema_dr, &_sema_dr_val);
-  if (!_sema_dr_val) 
-    sem_post(sema_dr);
+static inline void hcount_bucket_to_lstate(struct lscov_bucket* b, 
+    u8* lstate, const u8* hit_counts) {
+  /* Raw hit counts need no transformation; otherwise, the kernel picked for
+   * this CPU. */
+  if (!b->num_steps)
+    memcpy(lstate, hit_counts, lstate_size);
+  else
+    bucket_fn(b, lstate, hit_counts, lstate_size);
 }
 
-void hcount_stop() {
-  if (shm_hcount_id)
-    shmctl(shm_hcount_id, IPC_RMID, NULL);
+void hcount_mark_read(struct lscov_chan_slot* slot) {
+  slot->producer = 0;
+  lscov_chan_post(&slot->state, LSCOV_SLOT_FREE, &chan.hdr->rt_sleeping);
+}
 
-  if (sema_rd) {
-    sem_close(sema_rd);
-    sem_unlink(LSCOV_SEMA_RD_NAME);
-  }
-  
-  if (sema_dr) {
-    sem_close(sema_dr);
-    sem_unlink(LSCOV_SEMA_DR_NAME);
+void hcount_union(u8* map, u32 num_maps) {
+  /* Fold the other threads' maps into the first one (saturating). The result
+   * doesn't depend on which thread got which map. */
+  for (u32 t = 1; t < num_maps; t++) {
+    u8* other = map + (u64)t * lstate_size;
+    for (u32 i = 0; i < lstate_size; i++) {
+      u32 sum = map[i] + other[i];
+      map[i] = sum > 255 ? 255 : sum;
+    }
   }
 }
 
-void hcount_init() {
-  atexit(hcount_stop);
-
-  /* Initialize SHM. */
-  shm_hcount_id = shmget(LSCOV_SHM_HCOUNT_KEY, LSTATE_SIZE, 
-      IPC_CREAT | IPC_EXCL | 0600);
-  if (shm_hcount_id < 0) 
-    PFATAL("shmget() for hit_count failed");
-
-  hit_counts = (u8 *)shmat(shm_hcount_id, NULL, 0);
-  if (hit_counts == (void *)-1) 
-    PFATAL("shmat() for hit_count failed");
-
-  /* Initialize semaphores. */
-  sem_unlink(LSCOV_SEMA_RD_NAME);
-  sema_rd = sem_open(LSCOV_SEMA_RD_NAME, O_CREAT | O_EXCL, 0644, 0);
-  if (sema_rd == (void *)-1) 
-    PFATAL("sem_open() for sema_rd failed");
-
-  sem_unlink(LSCOV_SEMA_DR_NAME);
-  sema_dr = sem_open(LSCOV_SEMA_DR_NAME, O_CREAT | O_EXCL, 0644, 1);
-  if (sema_dr == (void *)-1) 
-    PFATAL("sem_open() for sema_dr failed");
-
-  /* Initialize 'hit_counts'. */
-  memset(hit_counts, 0, LSTATE_SIZE);
-
-#ifdef LSCOV_BUCKET
-  /* Initialize 'count_bucket_lookup16' */
-  for (u32 b1 = 0; b1 < 256; b1++) 
-    for (u32 b2 = 0; b2 < 256; b2++)
-      count_bucket_lookup16[(b1 << 8) + b2] = 
-        (count_bucket_lookup8[b1] << 8) |
-        count_bucket_lookup8[b2];
-#endif
+void hcount_stop() {
+  lscov_chan_destroy(&chan);
 }
 
+void hcount_init() {
+  atexit(hcount_stop);
 
-u32 bfilter_get_hash_index(const u8 *lstate, u32 seed) {
-  /* MurmurHash implementation by Joseph Werle.
-   * (https://github.com/jwerle/murmurhash.c/blob/master/murmurhash.c)
-   * Copyright (c) 2014-2022 joseph werle <joseph.werle@gmail.com> */
-
-  const u8 *key = lstate;
-	const u32 len = LSTATE_SIZE;
-  
-  u32 c1 = 0xcc9e2d51;
-  u32 c2 = 0x1b873593;
-  u32 r1 = 15;
-  u32 r2 = 13;
-  u32 m = 5;
-  u32 n = 0xe6546b64;
-  u32 h = 0;
-  u32 k = 0;
-  u8 *d = (u8 *) key; // 32 bit extract from `key'
-  const u32 *chunks = NULL;
-  const u8 *tail = NULL; // tail - last 8 bytes
-  int i = 0;
-  int l = len / 4; // chunk length
-
-  h = seed;
-
-  chunks = (const u32 *) (d + l * 4); // body
-  tail = (const u8 *) (d + l * 4); // last 8 byte chunk of `key'
-
-  // for each 4 byte chunk of `key'
-  for (i = -l; i != 0; ++i) {
-    // next 4 byte chunk of `key'
-    k = chunks[i];
-
-    // encode next 4 byte chunk of `key'
-    k *= c1;
-    k = (k << r1) | (k >> (32 - r1));
-    k *= c2;
-
-    // append to hash
-    h ^= k;
-    h = (h << r2) | (h >> (32 - r2));
-    h = h * m + n;
-  }
-
-  k = 0;
-
-  // remainder
-  switch (len & 3) { // `len % 4'
-    case 3: k ^= (tail[2] << 16);
-    case 2: k ^= (tail[1] << 8);
+  /* Create a channel. Hit counts are sized for the largest binary we accept;
+   * pages beyond what the binary actually uses are never touched. */
+  lscov_chan_create(&chan, chan_name, LSTATE_SIZE_MAX, num_slots, chan_flags,
+      sample_rate);
 
-    case 1:
-      k ^= tail[0];
-      k *= c1;
-      k = (k << r1) | (k >> (32 - r1));
-      k *= c2;
-      h ^= k;
-    case 0:;
-  }
+  /* Advertise it to whatever we (or the user) start from here on. */
+  setenv(LSCOV_CHAN_ENV, chan.path, 1);
 
-  h ^= len;
+  /* Bucketing table and kernel. */
+  const char* kernel;
+  lscov_bucket_init(bucket);
+  bucket_fn = lscov_bucket_select(&kernel);
+  ACTF("Bucketing: %s (%s), %s kernel", bucket->name, bucket->desc, kernel);
+}
 
-  h ^= (h >> 16);
-  h *= 0x85ebca6b;
-  h ^= (h >> 13);
-  h *= 0xc2b2ae35;
-  h ^= (h >> 16);
 
-  return h % bfilter_size_bits;
+u32 lstate_get_hash(const u8 *lstate, u32 seed) {
+  return lscov_hash_murmur3(lstate, lstate_size, seed);
 }
 
-void bfilter_set_1_by_index(u32 idx) {
+u8 bfilter_set_1_by_index(u8* filter, u32 idx) {
+  /* Returns 1 if the bit wasn't set yet. */
   // FIXME: bfilter --> limiting caching? other core?
 
   u32 byte_idx = idx >> 3;
@@ -302,15 +490,17 @@ void bfilter_set_1_by_index(u32 idx) {
     FATAL("bogus 'byte_idx' for a bloom filter (byte_idx: %d, size: %u)",
         byte_idx, bfilter_size);
 
-  bfilter[byte_idx] |= (1 << bit_idx);
+  u8 was = filter[byte_idx];
+  filter[byte_idx] = was | (1 << bit_idx);
+  return !(was & (1 << bit_idx));
 }
 
-u32 bfilter_get_num_1s() {
-  /* Tally 1s in the filter. */
+u32 bfilter_get_num_1s(const u8* filter, u32 size) {
+  /* Tally 1s in the filter (or any bitmap 'size' bytes long). */
   u32 num_1s = 0;
 
-  u64 *bfilter64 = (u64 *)bfilter;
-  u32 rem_size = bfilter_size >> 3;
+  const u64 *bfilter64 = (const u64 *)filter;
+  u32 rem_size = size >> 3;
   while (rem_size--) {
     num_1s += __builtin_popcountll(*bfilter64);
     bfilter64++;
@@ -319,25 +509,164 @@ u32 bfilter_get_num_1s() {
   return num_1s;
 }
 
-u32 bfilter_calc_cardinality(u32 num_1s) {
-  /* Estimate cardinality. */
-  static int has_divisor = 0;
-  static double divisor;
+u32 bfilter_calc_cardinality(u32 num_1s, u32 size_bits, u32 k) {
+  /* Estimate cardinality (of a filter 'size_bits' long with 'k' hashes). */
+  double divisor = k * log(1.0 - 1.0/size_bits);
 
-  if (!has_divisor) {
-    divisor = num_hashes * log(1.0 - 1.0/bfilter_size_bits);
-    has_divisor = 1;
-  }
+  /* A full filter could hold any number; say the most it can tell. */
+  if (num_1s >= size_bits)
+    num_1s = size_bits - 1;
 
-  double dividend = log(1.0 - (double)num_1s/bfilter_size_bits);
+  double dividend = log(1.0 - (double)num_1s/size_bits);
   u32 cov = (u32)(dividend / divisor);
 
   return cov;
 }
 
+double bfilter_calc_z(u8 percent) {
+  /* Two-sided: erfc(z / sqrt(2)) is the error rate. */
+  double lo = 0, hi = 10, z = 0;
+  for (int i = 0; i < 64; i++) {
+    z = (lo + hi) / 2;
+    if (erfc(z / M_SQRT2) > percent / 100.0)
+      lo = z;
+    else
+      hi = z;
+  }
+
+  return z;
+}
+
+void bfilter_calc_bounds(u32 num_1s, u32 size_bits, u32 k, u32* lower, 
+    u32* upper) {
+  /* The cardinality is a monotone function of the number of 1s, so bound
+   * the latter and map the bounds over. With q of the bits still 0, and
+   * t = -ln(q) the hashes per bit so far, the number of 1s has a variance
+   * of m q (1 - (1 + t) q) (Swamidass and Baldi, 2007), and is close
+   * enough to normal for a filter this large. */
+  double z = error_z;
+  double m = size_bits;
+  double q = 1.0 - num_1s / m;
+  double t = q > 0 ? -log(q) : 0;
+  double var = m * q * (1 - (1 + t) * q);
+  double delta = z * sqrt(var > 0 ? var : 0);
+
+  *lower = num_1s > delta ? 
+    bfilter_calc_cardinality(num_1s - delta, size_bits, k) : 0;
+  *upper = bfilter_calc_cardinality(num_1s + delta < m ? num_1s + delta : m,
+      size_bits, k);
+}
+
+void bfilter_check_density(u32 num_1s, u32 cov) {
+  /* Past this, a few bits make a huge difference in the estimate, and the
+   * bounds widen fast. Tell what would've been enough. */
+  static u8 warned;
+  if (warned || num_1s < bfilter_size_bits * 0.9)
+    return;
+
+  u64 needed_mb = (u64)(num_hashes * (double)cov / M_LN2 / 8) >> 20;
+  WARNF("Bloom filter is %u%% full; estimates are getting unreliable. "
+      "(-m %lu or more for this many)", 
+      (u32)((u64)num_1s * 100 / bfilter_size_bits), needed_mb + 1);
+  warned = 1;
+}
+
+void sbf_add_stage() {
+  struct sbf_stage* st = &sbf[sbf_num_stages];
+  struct sbf_stage* prev = sbf_num_stages ? st - 1 : NULL;
+
+  st->size = !prev ? sbf_size_init : 
+    prev->size < SBF_SIZE_MAX ? prev->size << 1 : prev->size;
+  st->size_bits = st->size << 3;
+  st->num_hashes = !prev ? num_hashes : prev->num_hashes + 1;
+  st->bits = mmap(0, st->size, PROT_READ | PROT_WRITE, 
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (st->bits == MAP_FAILED)
+    PFATAL("bloom filter allocation failed.");
+
+  sbf_num_stages++;
+  if (prev)
+    ACTF("Bloom filter grown. (stage %u: %'u KiB, %u hashes)", 
+        sbf_num_stages, st->size >> 10, st->num_hashes);
+}
+
+static inline u8 sbf_stage_has(struct sbf_stage* st, u32 a, u32 b) {
+  for (u32 h = 0; h < st->num_hashes; h++) {
+    u32 idx = ((u64)a + (u64)h * b) % st->size_bits;
+    if (!(st->bits[idx >> 3] & (1 << (idx & 7))))
+      return 0;
+  }
+
+  return 1;
+}
+
+u8 sbf_insert(u64 fp) {
+  /* Returns 1 if the logic state is new (as far as the stages can tell). */
+  u32 a = fp >> 32;
+  u32 b = (u32)fp | 1;
+  u8 is_new = 0;
+
+  for (u32 i = 0; i + 1 < sbf_num_stages; i++)
+    if (sbf_stage_has(&sbf[i], a, b))
+      return 0;
+
+  struct sbf_stage* st = &sbf[sbf_num_stages - 1];
+  for (u32 h = 0; h < st->num_hashes; h++) {
+    u32 idx = ((u64)a + (u64)h * b) % st->size_bits;
+    u8 bit = 1 << (idx & 7);
+    if (!(st->bits[idx >> 3] & bit)) {
+      st->bits[idx >> 3] |= bit;
+      st->num_1s++;
+      is_new = 1;
+    }
+  }
+
+  if (st->num_1s > st->size_bits * SBF_FILL_MAX && 
+      sbf_num_stages < SBF_STAGES_MAX)
+    sbf_add_stage();
+
+  return is_new;
+}
+
+u32 sbf_calc_cardinality(u32* lower, u32* upper) {
+  /* Stages hold disjoint sets: add them up. A new logic state that an earlier
+   * stage took for a known one (a false positive) never made it to the later
+   * stage, so scale each stage up by the chance of getting past the earlier
+   * ones. */
+  double cov = 0, lower_sum = 0, upper_sum = 0;
+  double pass = 1;
+
+  for (u32 i = 0; i < sbf_num_stages; i++) {
+    struct sbf_stage* st = &sbf[i];
+    cov += bfilter_calc_cardinality(st->num_1s, st->size_bits, 
+        st->num_hashes) / pass;
+
+    if (error_percent > 0) {
+      u32 lo, hi;
+      bfilter_calc_bounds(st->num_1s, st->size_bits, st->num_hashes, 
+          &lo, &hi);
+      lower_sum += lo / pass;
+      upper_sum += hi / pass;
+    }
+
+    pass *= 1 - pow((double)st->num_1s / st->size_bits, st->num_hashes);
+  }
+
+  *lower = lower_sum;
+  *upper = upper_sum;
+  return cov;
+}
+
 void bfilter_init() {
   bfilter_size_bits = (bfilter_size << 3);
 
+  if (sbf_mode) {
+    sbf_add_stage();
+    bfilter = sbf[0].bits;
+    ACTF("Bloom filter: %'u KiB to start with, growing", sbf_size_init >> 10);
+    return;
+  }
+
   /* Allocate memory for a bloom filter. MAP_ANONYMOUS will automatically
    * zeroize the filter. */
   bfilter = mmap(0, bfilter_size, PROT_READ | PROT_WRITE, 
@@ -347,8 +676,493 @@ void bfilter_init() {
 }
 
 
+void view_add(const char* spec) {
+  /* 'edge', 'lstate:<scheme>', or 'bedge:<scheme>'. */
+  if (num_views == VIEWS_MAX)
+    FATAL("too many views (max: %u)", VIEWS_MAX - 1);
+
+  struct lscov_view* v = &views[num_views++];
+  const char* scheme = strchr(spec, ':');
+  snprintf(v->name, sizeof(v->name), "%s", spec);
+
+  if (!strcmp(spec, "edge")) {
+    v->kind = VIEW_BEDGE;
+    scheme = "1";
+  } else if (scheme && !strncmp(spec, "lstate:", 7)) {
+    v->kind = VIEW_LSTATE;
+    scheme++;
+  } else if (scheme && !strncmp(spec, "bedge:", 6)) {
+    v->kind = VIEW_BEDGE;
+    scheme++;
+  } else {
+    FATAL("bad view '%s' (edge, lstate:<scheme>, or bedge:<scheme>)", spec);
+  }
+
+  v->bucket = lscov_bucket_find(scheme);
+  if (!v->bucket)
+    FATAL("bad bucketing scheme '%s' for view '%s'", scheme, spec);
+
+  /* Buckets are told apart by bits, so they'd better be single bits. */
+  if (v->kind == VIEW_BEDGE) {
+    u8 one_hot = v->bucket->num_steps > 0;
+    for (u32 s = 0; s < v->bucket->num_steps; s++)
+      one_hot &= !(v->bucket->val[s] & (v->bucket->val[s] - 1));
+    if (!one_hot)
+      FATAL("bucketing '%s' doesn't work with bucketed edges", scheme);
+  }
+}
+
+static u8* view_alloc(u32 size) {
+  u8* mem = mmap(0, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    PFATAL("view allocation failed.");
+
+  return mem;
+}
+
+void view_init() {
+  /* Called once the logic state size is known. Views with the same bucketing
+   * share their bucketed maps, so each scheme runs once per execution. */
+  for (u32 i = 0; i < num_views; i++) {
+    struct lscov_view* v = &views[i];
+
+    lscov_bucket_init(v->bucket);
+    for (u32 j = 0; j < i && !v->lstate; j++) {
+      if (views[j].bucket == v->bucket) {
+        v->lstate = views[j].lstate;
+        v->shares_lstate = 1;
+      }
+    }
+    if (!v->lstate)
+      v->lstate = view_alloc(lstate_size);
+
+    if (!i)
+      v->bits = bfilter;
+    else
+      v->bits = view_alloc(v->kind == VIEW_LSTATE ? bfilter_size : lstate_size);
+
+    if (i)
+      ACTF("View: %s", v->name);
+  }
+}
+
+static inline u8 view_update(struct lscov_view* v) {
+  /* Returns 1 if the execution added to the view (a new logic state, or a
+   * new bucketed edge). */
+  u8 is_new = 0;
+
+  if (v->kind == VIEW_LSTATE && v == views && sbf_mode) {
+    v->fp = ((u64)lstate_get_hash(v->lstate, 0) << 32) | 
+      lstate_get_hash(v->lstate, 1);
+    is_new = sbf_insert(v->fp);
+  } else if (v->kind == VIEW_LSTATE) {
+    /* Set the hash indices of the logic state to 1 in the filter. The first
+     * two hashes make its fingerprint. */
+    u32 hash[2] = { 0, 0 };
+    for (int h = 0; h < num_hashes; h++) {
+      u32 hval = lstate_get_hash(v->lstate, h);
+      is_new |= bfilter_set_1_by_index(v->bits, hval % bfilter_size_bits);
+      if (h < 2)
+        hash[h] = hval;
+    }
+    if (num_hashes < 2)
+      hash[1] = lstate_get_hash(v->lstate, 1);
+
+    v->fp = ((u64)hash[0] << 32) | hash[1];
+  } else {
+    /* Fold the bucketed map in (mostly zeros). */
+    const u64* src = (const u64 *)v->lstate;
+    u64* dst = (u64 *)v->bits;
+    for (u32 i = 0; i < lstate_size >> 3; i++) {
+      if (unlikely(src[i] & ~dst[i])) {
+        dst[i] |= src[i];
+        is_new = 1;
+      }
+    }
+  }
+
+  return is_new;
+}
+
+u32 view_get_cov(struct lscov_view* v) {
+  if (v->kind == VIEW_LSTATE)
+    return bfilter_calc_cardinality(bfilter_get_num_1s(v->bits, bfilter_size),
+        bfilter_size_bits, num_hashes);
+  else
+    return bfilter_get_num_1s(v->bits, lstate_size);
+}
+
+
+void cms_init() {
+  cms_num_lines = ((u64)cms_size_kb << 10) / (CMS_LINE * sizeof(u32));
+
+  cms = mmap(0, (u64)cms_num_lines * CMS_LINE * sizeof(u32), 
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (cms == MAP_FAILED)
+    PFATAL("frequency sketch allocation failed.");
+
+  ACTF("Frequency sketch: %'u KiB", cms_size_kb);
+}
+
+void cms_update(u64 fp, u8 is_new) {
+  /* The line from the fingerprint, the counters from a remix of it. */
+  u32* line = cms + (u64)((u32)fp % cms_num_lines) * CMS_LINE;
+  u64 h = lscov_hash_fmix64(fp);
+  u32* ctrs[CMS_DEPTH];
+  u32 min = UINT32_MAX;
+
+  for (u32 d = 0; d < CMS_DEPTH; d++) {
+    ctrs[d] = &line[d * CMS_ROW + (u32)(h >> (d * 8)) % CMS_ROW];
+    if (*ctrs[d] < min)
+      min = *ctrs[d];
+  }
+
+  /* Conservative update: only raise the counters at the minimum. */
+  for (u32 d = 0; d < CMS_DEPTH; d++)
+    if (*ctrs[d] == min)
+      (*ctrs[d])++;
+
+  /* Whether the state is new is the filter's call: once lines fill up, the
+   * minimum of a new state is hardly ever 0, and singletons would go missing
+   * (and P(new) collapse). For an old one, the sketch can only overestimate
+   * how often it was seen, which errs on keeping singletons. */
+  u32 seen = is_new ? 0 : min;
+
+  if ((seen == 1 || seen == 2) && cms_freq[seen])
+    cms_freq[seen]--;
+  if (seen + 1 <= 2)
+    cms_freq[seen + 1]++;
+
+  cms_total++;
+}
+
+void cms_estimate(u32 cov, u32* chao1, double* pnew) {
+  /* Treat logic states as species and executions as samples. With f1 and f2
+   * states seen once and twice out of n, Chao1 (bias-corrected) tells how
+   * many states there are in total, and Good-Turing the probability that the
+   * next execution finds a new one. */
+  double f1 = cms_freq[1];
+  double f2 = cms_freq[2];
+  double n = cms_total;
+
+  if (!cms_total) {
+    *chao1 = cov;
+    *pnew = 1;
+    return;
+  }
+
+  *chao1 = cov + (u32)((n - 1) / n * f1 * (f1 - 1) / (2 * (f2 + 1)));
+  *pnew = f1 / n;
+}
+
+
+
+void topk_init() {
+  topk = calloc(topk_size, sizeof(struct topk_entry));
+  topk_order = calloc(topk_size, sizeof(u32));
+  topk_pos = calloc(topk_size, sizeof(u32));
+  topk_groups = calloc(topk_size, sizeof(struct topk_group));
+  topk_free_groups = calloc(topk_size, sizeof(u32));
+
+  for (topk_hash_size = 1; topk_hash_size < topk_size * 2; 
+      topk_hash_size <<= 1);
+  topk_hash = calloc(topk_hash_size, sizeof(u32));
+
+  if (!topk || !topk_order || !topk_pos || !topk_groups || 
+      !topk_free_groups || !topk_hash)
+    PFATAL("heavy hitter allocation failed.");
+
+  /* Start with all entries unused, i.e., a single group of count 0. */
+  for (u32 i = 0; i < topk_size; i++) {
+    topk_order[i] = topk_pos[i] = i;
+    topk_free_groups[topk_num_free_groups++] = topk_size - 1 - i;
+  }
+  topk_groups[topk_free_groups[--topk_num_free_groups]] = 
+    (struct topk_group){ 0, topk_size - 1 };
+
+  /* Only for 'Top10(%)' with -f alone. */
+  if (!topk_out) {
+    ACTF("Heavy hitters: %u", topk_size);
+    return;
+  }
+
+  if (asprintf(&top_path, "%s.top", out_path) < 0)
+    PFATAL("asprintf() failed.");
+
+  FILE *fout = fopen(top_path, "w");
+  fprintf(fout, "Time,Rank,Fingerprint,Count,Error,Indices\n");
+  fclose(fout);
+
+  ACTF("Heavy hitters: %u (out: %s)", topk_size, top_path);
+}
+
+static inline u32* topk_hash_find(u64 fp) {
+  /* The slot of 'fp', or the empty slot to put it in. */
+  u32 h = (u32)fp & (topk_hash_size - 1);
+  while (topk_hash[h] && topk[topk_hash[h] - 1].fp != fp)
+    h = (h + 1) & (topk_hash_size - 1);
+
+  return &topk_hash[h];
+}
+
+static inline void topk_hash_remove(u64 fp) {
+  /* Linear probing: shift the rest of the cluster back into the hole. */
+  u32 hole = topk_hash_find(fp) - topk_hash;
+  u32 h = hole;
+  topk_hash[hole] = 0;
+
+  while (1) {
+    h = (h + 1) & (topk_hash_size - 1);
+    if (!topk_hash[h])
+      break;
+
+    u32 home = (u32)topk[topk_hash[h] - 1].fp & (topk_hash_size - 1);
+    if (((h - home) & (topk_hash_size - 1)) >= 
+        ((h - hole) & (topk_hash_size - 1))) {
+      topk_hash[hole] = topk_hash[h];
+      topk_hash[h] = 0;
+      hole = h;
+    }
+  }
+}
+
+static inline void topk_bump(u32 id) {
+  /* Move the entry to the front of its group, and on to the group before. */
+  struct topk_entry* e = &topk[id];
+  struct topk_group* g = &topk_groups[e->group];
+  u32 pos = topk_pos[id];
+  u32 front = g->start;
+
+  u32 other = topk_order[front];
+  topk_order[front] = id;
+  topk_order[pos] = other;
+  topk_pos[id] = front;
+  topk_pos[other] = pos;
+
+  if (g->start == g->end)
+    topk_free_groups[topk_num_free_groups++] = e->group;
+  else
+    g->start++;
+
+  e->count++;
+
+  struct topk_entry* prev = front ? &topk[topk_order[front - 1]] : NULL;
+  if (prev && prev->count == e->count) {
+    e->group = prev->group;
+    topk_groups[e->group].end = front;
+  } else {
+    e->group = topk_free_groups[--topk_num_free_groups];
+    topk_groups[e->group] = (struct topk_group){ front, front };
+  }
+}
+
+void topk_update(u64 fp, const u8* lstate) {
+  u32* slot = topk_hash_find(fp);
+  topk_total++;
+
+  if (!*slot) {
+    /* Not followed: take over the least frequent entry, inheriting its
+     * count as the error. */
+    u32 id = topk_order[topk_size - 1];
+    struct topk_entry* e = &topk[id];
+    if (e->count) {
+      topk_hash_remove(e->fp);
+      slot = topk_hash_find(fp);
+    }
+
+    e->fp = fp;
+    e->error = e->count;
+    e->num_indices = 0;
+    *slot = id + 1;
+  }
+
+  u32 id = *slot - 1;
+  struct topk_entry* e = &topk[id];
+  topk_bump(id);
+
+  /* Seen again while followed: likely to stay, so worth a look. */
+  if (e->count == e->error + 2) {
+    const u64* lstate64 = (const u64 *)lstate;
+    for (u32 i = 0; i < lstate_size >> 3; i++) {
+      if (likely(!lstate64[i]))
+        continue;
+      for (u32 j = i << 3; j < (i + 1) << 3; j++) {
+        if (!lstate[j])
+          continue;
+        if (e->num_indices < TOPK_INDICES)
+          e->indices[e->num_indices] = j;
+        e->num_indices++;
+      }
+    }
+  }
+}
+
+float topk_get_top_share() {
+  /* Out of all logic states counted, how many were the most frequent ones
+   * (overestimated, as their counts are). */
+  u64 top = 0;
+  for (u32 r = 0; r < topk_size && r < TOPK_SHARE; r++)
+    top += topk[topk_order[r]].count;
+
+  return topk_total ? (float)top / topk_total * 100 : 0;
+}
+
+void topk_print(FILE* fout, u32 time) {
+  /* Doesn't stop the loop; entries may move while we're at it. */
+  for (u32 r = 0; r < topk_size; r++) {
+    struct topk_entry* e = &topk[topk_order[r]];
+    if (!e->count)
+      break;
+
+    fprintf(fout, "%u,%u,%016lx,%u,%u,", time, r + 1, e->fp, e->count, 
+        e->error);
+    for (u32 i = 0; i < e->num_indices && i < TOPK_INDICES; i++)
+      fprintf(fout, i ? " %u" : "%u", e->indices[i]);
+    if (e->num_indices > TOPK_INDICES)
+      fprintf(fout, " ...");
+    fprintf(fout, "\n");
+  }
+}
+
+void topk_dump(u32 time) {
+  /* Tallies, SIGUSR1 and the control socket may all ask at once. */
+  if (!top_path)
+    return;
+
+  pthread_mutex_lock(&topk_dump_lock);
+  FILE *fout = fopen(top_path, "a");
+  topk_print(fout, time);
+  fclose(fout);
+  pthread_mutex_unlock(&topk_dump_lock);
+}
+
+
+static u64 evlog_now_us() {
+  /* Since the log start, unaffected by clock steps. */
+  return (lscov_now_ns() - evlog_start_ns) / 1000;
+}
+
+static inline void evlog_push(u32 producer, u64 fp, u8 is_new) {
+  /* Single producer (the loop), single consumer (the writer). */
+  u64 head = evlog_head;
+  if (head - __atomic_load_n(&evlog_tail, __ATOMIC_ACQUIRE) == 
+      EVLOG_RING_SIZE) {
+    evlog_dropped++;
+    return;
+  }
+
+  struct lscov_event* ev = &evlog_ring[head & (EVLOG_RING_SIZE - 1)];
+  ev->time_us = evlog_now_us();
+  ev->exec = exec_count;
+  ev->producer = producer;
+  ev->flags = is_new ? LSCOV_EVENT_NEW : 0;
+  ev->fp = fp;
+
+  __atomic_store_n(&evlog_head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void thread_block_signals() {
+  /* For threads other than the loop. A client that hangs up early gets
+   * EPIPE, not the daemon down with it. (Ignoring SIGPIPE instead would
+   * carry over to the fuzzer.) The rest go to the loop, which is woken up by
+   * them and does what they ask. */
+  static const int sigs[] = { SIGPIPE, SIGINT, SIGHUP, SIGTERM, SIGUSR1,
+    SIGCHLD };
+  sigset_t set;
+  sigemptyset(&set);
+  for (u32 i = 0; i < sizeof(sigs) / sizeof(int); i++)
+    sigaddset(&set, sigs[i]);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void* evlog_write(void* _unused) {
+  /* Write full blocks as they fill up, and whatever there is every now and
+   * then, so that the log is never far behind. Drain the ring when asked to
+   * stop. */
+  static struct lscov_event batch[LSCOV_EVBLOCK_EVENTS];
+  u8* block = malloc(sizeof(struct lscov_evblock_hdr) + 
+      LSCOV_EVBLOCK_SIZE_MAX);
+  if (!block)
+    PFATAL("event log allocation failed.");
+
+  thread_block_signals();
+  u64 last_write_us = evlog_now_us();
+
+  while (1) {
+    u8 stopping = __atomic_load_n(&evlog_stop_soon, __ATOMIC_ACQUIRE);
+    u64 tail = evlog_tail;
+    u64 num = __atomic_load_n(&evlog_head, __ATOMIC_ACQUIRE) - tail;
+
+    if (num < LSCOV_EVBLOCK_EVENTS && !stopping && (!num || 
+          evlog_now_us() - last_write_us < EVLOG_FLUSH_MS * 1000)) {
+      usleep(EVLOG_POLL_US);
+      continue;
+    }
+
+    if (!num)
+      break;
+
+    /* Copy the events out first, and let the loop have their room back. */
+    u32 n = num < LSCOV_EVBLOCK_EVENTS ? num : LSCOV_EVBLOCK_EVENTS;
+    for (u32 i = 0; i < n; i++)
+      batch[i] = evlog_ring[(tail + i) & (EVLOG_RING_SIZE - 1)];
+    __atomic_store_n(&evlog_tail, tail + n, __ATOMIC_RELEASE);
+
+    u32 size = lscov_evblock_encode(block, batch, n);
+    if (fwrite(block, size, 1, evlog_file) != 1)
+      PFATAL("cannot write to '%s'", evlog_path);
+    fflush(evlog_file);
+
+    last_write_us = evlog_now_us();
+  }
+
+  free(block);
+  return NULL;
+}
+
+void evlog_stop() {
+  __atomic_store_n(&evlog_stop_soon, 1, __ATOMIC_RELEASE);
+  pthread_join(evlog_writer, NULL);
+  fclose(evlog_file);
+
+  OKF("Event log: %'lu event(s), %'lu dropped (out: %s)", evlog_tail,
+      evlog_dropped, evlog_path);
+}
+
+void evlog_init() {
+  if (asprintf(&evlog_path, "%s.ev", out_path) < 0)
+    PFATAL("asprintf() failed.");
+
+  evlog_file = fopen(evlog_path, "w");
+  if (!evlog_file)
+    PFATAL("cannot open '%s'", evlog_path);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  evlog_start_ns = lscov_now_ns();
+
+  struct lscov_evlog_hdr hdr = { .version = LSCOV_EVLOG_VERSION,
+    .hdr_size = sizeof(hdr), 
+    .start_time_us = (u64)now.tv_sec * 1000000 + now.tv_nsec / 1000 };
+  memcpy(hdr.magic, LSCOV_EVLOG_MAGIC, sizeof(hdr.magic));
+  fwrite(&hdr, sizeof(hdr), 1, evlog_file);
+  fflush(evlog_file);
+
+  evlog_ring = calloc(EVLOG_RING_SIZE, sizeof(struct lscov_event));
+  if (!evlog_ring)
+    PFATAL("event log allocation failed.");
+
+  if (pthread_create(&evlog_writer, NULL, evlog_write, NULL))
+    PFATAL("cannot start the event log writer");
+  atexit(evlog_stop);
+
+  ACTF("Event log: on (out: %s)", evlog_path);
+}
+
+
 static inline int tally_is_next_time() {
-  return (next_tallying_time < time(NULL));
+  return (next_tallying_time <= time(NULL));
 }
 
 time_t tally_update_next_time() {
@@ -358,10 +1172,17 @@ time_t tally_update_next_time() {
   time_t prev_next_time = next_tallying_time;
 
   if (!next_tallying_time) 
-    next_tallying_time = start_time;
+    next_tallying_time = tally_base_time = start_time;
 
-  u32 prev_iter_num = (next_tallying_time - start_time) / tallying_period;
-  next_tallying_time = start_time + (prev_iter_num + 1) * tallying_period;
+  /* A new period (from the control socket) counts from this tally on. */
+  time_t period = __atomic_exchange_n(&new_period, 0, __ATOMIC_ACQ_REL);
+  if (period) {
+    tallying_period = period;
+    tally_base_time = next_tallying_time;
+  }
+
+  u32 prev_iter_num = (next_tallying_time - tally_base_time) / tallying_period;
+  next_tallying_time = tally_base_time + (prev_iter_num + 1) * tallying_period;
 
   /* Wait at most until the next tallying time. */
   loop_timeout.tv_sec = next_tallying_time;
@@ -379,85 +1200,416 @@ void lscov_init() {
   setlocale(LC_NUMERIC, "en_US.UTF-8");
 }
 
-void* lscov_report(void * _unused) {
-  static u32 prev_cov = 0;
+u32 lscov_get_cov(u32* lower, u32* upper, float* density) {
+  /* The primary logic state count so far (and the bounds, if asked for). */
+  u32 cov;
+  *lower = *upper = 0;
+
+  if (sbf_mode) {
+    struct sbf_stage* st = &sbf[sbf_num_stages - 1];
+    cov = sbf_calc_cardinality(lower, upper);
+    *density = (float)st->num_1s / st->size_bits * 100;
+  } else {
+    u32 num_1s = bfilter_get_num_1s(bfilter, bfilter_size);
+    cov = bfilter_calc_cardinality(num_1s, bfilter_size_bits, num_hashes); 
+
+    if (error_percent > 0)
+      bfilter_calc_bounds(num_1s, bfilter_size_bits, num_hashes, lower, 
+          upper);
+    bfilter_check_density(num_1s, cov);
+
+    *density = (float)num_1s / bfilter_size_bits * 100;
+  }
+
+  return cov;
+}
+
+
+/* Metrics, in the Prometheus text format (a textfile for node_exporter's
+ * collector), or OpenMetrics (served over HTTP). Counters are written by the
+ * loop alone and loaded atomically, and estimates are the last tally's, so
+ * scraping never holds up the loop, nor has side effects. */
+
+static void metrics_hist(FILE* out, const char* name, const char* help,
+    struct lscov_hist* h) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+  /* Powers of two are enough of a resolution here. */
+  u64 cum = 0;
+  for (u32 b = 0; b < LSCOV_HIST_BUCKETS; b++) {
+    cum += __atomic_load_n(&h->count[b], __ATOMIC_RELAXED);
+    if (b < LSCOV_HIST_BUCKETS - 1 && (b + 1) % LSCOV_HIST_SUB == 0)
+      fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, 
+          lscov_hist_lower(b + 1) / 1e9, cum);
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cum);
+  fprintf(out, "%s_count %lu\n", name, cum);
+  fprintf(out, "%s_sum %g\n", name, 
+      __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+}
+
+static void metrics_print(FILE* out, u8 openmetrics) {
+  /* OpenMetrics names counter families without '_total'. */
+  const char* total = openmetrics ? "" : "_total";
+  pthread_mutex_lock(&tally_lock);
+  u32 cov = tally_cov, lower = tally_lower, upper = tally_upper;
+  float density = tally_density;
+  pthread_mutex_unlock(&tally_lock);
+
+#define METRIC_LOAD(_var) __atomic_load_n(&(_var), __ATOMIC_RELAXED)
+
+#define METRIC_COUNTER(_name, _help, _val) \
+  fprintf(out, "# HELP lscov_%s%s %s\n# TYPE lscov_%s%s counter\n" \
+      "lscov_%s_total %lu\n", _name, total, _help, _name, total, _name, \
+      (u64)(_val))
+
+#define METRIC_GAUGE(_name, _help, _fmt, _val) \
+  fprintf(out, "# HELP lscov_%s %s\n# TYPE lscov_%s gauge\n" \
+      "lscov_%s " _fmt "\n", _name, _help, _name, _name, _val)
+
+  METRIC_COUNTER("execs", "Executions measured.", METRIC_LOAD(exec_count));
+  METRIC_COUNTER("execs_started", "Executions started, measured or not.",
+      METRIC_LOAD(chan.hdr->exec_tick));
+  METRIC_COUNTER("execs_dropped", "Sampled executions that found no slot.",
+      METRIC_LOAD(chan.hdr->dropped));
+  METRIC_COUNTER("crashes", "Executions that caught a fatal signal.",
+      METRIC_LOAD(crash_count));
+  METRIC_COUNTER("hangs", "Executions that died silently.", 
+      METRIC_LOAD(hang_count));
+  if (evlog_ring)
+    METRIC_COUNTER("events_dropped", "Events the event log dropped.",
+        METRIC_LOAD(evlog_dropped));
+
+  METRIC_GAUGE("logic_states", "Distinct logic states (estimated).", "%u", 
+      cov);
+  if (error_percent > 0) {
+    METRIC_GAUGE("logic_states_lower", "Lower bound of logic_states.", "%u",
+        lower);
+    METRIC_GAUGE("logic_states_upper", "Upper bound of logic_states.", "%u",
+        upper);
+  }
+  METRIC_GAUGE("bloom_density_ratio", "Share of Bloom filter bits set.", 
+      "%g", density / 100);
+  METRIC_GAUGE("uptime_seconds", "Time since recording started.", "%lu",
+      start_time ? time(NULL) - start_time : 0);
+
+#undef METRIC_LOAD
+#undef METRIC_COUNTER
+#undef METRIC_GAUGE
+
+  metrics_hist(out, "lscov_ingest_seconds", 
+      "Time to take in an execution, from its slot ready to done.", 
+      &ingest_hist);
+  metrics_hist(out, "lscov_handshake_wait_seconds",
+      "Time waiting for an execution's slot to get ready.", &wait_hist);
+  metrics_hist(out, "lscov_target_wait_seconds",
+      "Time executions took to get going (mostly waiting for a slot).", 
+      &chan.hdr->rt_wait);
+
+  if (openmetrics)
+    fprintf(out, "# EOF\n");
+}
+
+void metrics_write() {
+  /* Whole files only, for the collector to pick up. */
+  FILE* out = fopen(metrics_tmp_path, "w");
+  if (!out) {
+    WARNF("cannot write metrics to '%s' (%s)", metrics_tmp_path, 
+        strerror(errno));
+    return;
+  }
+  metrics_print(out, 0);
+  fclose(out);
+
+  if (rename(metrics_tmp_path, metrics_spec))
+    WARNF("cannot rename '%s' (%s)", metrics_tmp_path, strerror(errno));
+}
 
+void* lscov_report(void * _tally_time) {
   if (!start_time)
     return NULL;
 
-  time_t prev_next_time = tally_update_next_time();
+  pthread_mutex_lock(&report_lock);
+
+  /* The loop moves on to the next tallying time before spawning us (it no
+   * longer blocks until the next execution, so it would spawn again). */
+  time_t prev_next_time = (time_t)(intptr_t)_tally_time;
   if (stop_soon)
     prev_next_time = time(NULL);
 
   u32 prev_time = prev_next_time - start_time;
-  u32 num_1s = bfilter_get_num_1s();
-  u32 cov = bfilter_calc_cardinality(num_1s); 
-  // TODO: calculate error bounds.
-  
-  float density = (float)num_1s / bfilter_size_bits * 100;
-  u32 rate_ins = (u32)((cov - prev_cov) / tallying_period);
-  float rate_per = !exec_count_in_period ? 
+  u32 lower_err, upper_err;
+  float density;
+  u32 cov = lscov_get_cov(&lower_err, &upper_err, &density);
+
+  pthread_mutex_lock(&tally_lock);
+  tally_cov = cov;
+  tally_lower = lower_err;
+  tally_upper = upper_err;
+  tally_density = density;
+  pthread_mutex_unlock(&tally_lock);
+
+  /* Not always a whole period (the last one, or one asked for). */
+  u32 elapsed = prev_time > prev_prev_time ? prev_time - prev_prev_time : 1;
+  u32 rate_ins = (u32)((cov - prev_cov) / elapsed);
+  float rate_per = exec_count_in_period ? 
     (float)(cov - prev_cov) / exec_count_in_period * 100 : 0;
-  u32 rate_avg = (u32)(cov / prev_time); 
-  float rate_per_avg = !exec_count ? 
+  u32 rate_avg = prev_time ? (u32)(cov / prev_time) : 0;
+  float rate_per_avg = exec_count ? 
     (float)cov / exec_count * 100 : 0;
 
+  /* Executions we didn't see (not sampled, or no free slot) would've found
+   * new logic states at the same rate as the ones we did. */
+  u64 total = chan.hdr->exec_tick;
+  u64 dropped = chan.hdr->dropped;
+  u32 seen = exec_count - prev_exec_count;
+  u32 rate_ext = seen ? 
+    (u32)((double)rate_ins * (total - prev_total) / seen) : rate_ins;
+
+  u32 chao1 = 0;
+  double pnew = 0;
+  if (cms) {
+    cms_estimate(cov, &chao1, &pnew);
+    if (stop_pnew > 0 && pnew < stop_pnew && !saturated) {
+      OKF("Saturated. (P(new): %g, Chao1: %'u)", pnew, chao1);
+      saturated = 1;
+    }
+  }
+
+  u32 view_covs[VIEWS_MAX];
+  for (u32 i = 1; i < num_views; i++)
+    view_covs[i] = view_get_cov(&views[i]);
+
+  /* Latencies of this period: how long executions waited to start, and how
+   * long we took for each. */
+  static const double quantiles[2] = { 0.5, 0.99 };
+  double rt_wait[2], ingest[2];
+  if (latency_mode) {
+    lscov_hist_quantiles(&chan.hdr->rt_wait, &prev_rt_wait, quantiles, 
+        rt_wait, 2);
+    lscov_hist_quantiles(&ingest_hist, &prev_ingest, quantiles, ingest, 2);
+  }
+
 #ifdef PRINT_STAT
   SAYF("    density: %3.2f%%, rate: (ins) %'u ls/sec [%3.2f%%], (avg) %'u ls/sec [%3.2f%%]\n",
       density, rate_ins, rate_per, rate_avg, rate_per_avg);
 #endif
 
-  out_append(prev_time, cov, 0, 0, density, rate_ins, rate_per, rate_avg, rate_per_avg);
-  OKF("Recorded new coverage. (time: %u, cov: %'u)", prev_time, cov);
+  /* In the order of out_init(). */
+  union lscov_series_value row[LSCOV_SERIES_FIELDS_MAX];
+  u32 n = 0;
+  row[n++].u = prev_time;
+  row[n++].u = cov;
+  if (error_percent > 0) {
+    row[n++].u = lower_err;
+    row[n++].u = upper_err;
+  }
+  row[n++].f = density;
+  row[n++].u = rate_ins;
+  row[n++].f = rate_per;
+  row[n++].u = rate_avg;
+  row[n++].f = rate_per_avg;
+  row[n++].u = exec_count;
+  row[n++].u = crash_count;
+  row[n++].u = hang_count;
+  row[n++].u = total;
+  row[n++].u = dropped;
+  row[n++].u = rate_ext;
+  if (topk)
+    row[n++].f = topk_get_top_share();
+  if (cms) {
+    row[n++].u = cms_freq[1];
+    row[n++].u = cms_freq[2];
+    row[n++].u = chao1;
+    row[n++].f = pnew;
+  }
+  for (u32 i = 1; i < num_views; i++)
+    row[n++].u = view_covs[i];
+  if (latency_mode) {
+    row[n++].f = rt_wait[0] / 1000;
+    row[n++].f = rt_wait[1] / 1000;
+    row[n++].f = ingest[0] / 1000;
+    row[n++].f = ingest[1] / 1000;
+  }
+
+  out_append(row, n);
+  if (metrics_on && !metrics_port)
+    metrics_write();
+  if (topk)
+    topk_dump(prev_time);
+  OKF("Recorded new coverage. (time: %u, cov: %'u, execs: %'u/%'lu, "
+      "dropped: %'lu, crashes: %'u, hangs: %'u)", prev_time, cov, exec_count, 
+      total, dropped, crash_count, hang_count);
+  if (latency_mode)
+    ACTF("Latency (p50/p99): start %.1f/%.1f us, ingest %.1f/%.1f us", 
+        rt_wait[0] / 1000, rt_wait[1] / 1000, ingest[0] / 1000, 
+        ingest[1] / 1000);
       
   exec_count_in_period = 0;
   prev_cov = cov;
+  prev_exec_count = exec_count;
+  prev_total = total;
+  prev_prev_time = prev_time;
+  last_tally_time = prev_next_time;
 
+  pthread_mutex_unlock(&report_lock);
   return NULL;
 }
 
+static void* lscov_report_thread(void* _tally_time) {
+  thread_block_signals();
+  return lscov_report(_tally_time);
+}
+
+void lscov_stop(int sig);
+
 void lscov_wait() {
-  /* Wait for the instrumented binary to report that it started.
-   * We just busy-wait here because nobody is using computation resource in a
-   * meaningful way at this point (and it's cheap for the instrumented binary
-   * to do every execution) */
-  while (*hit_counts != 0x80)
-    continue;
+  /* Wait for the instrumented binary to report that it started, which it
+   * does by telling its map size. Sleeps on the futex, so a daemon started
+   * long before the fuzzer costs nothing. */
+  struct lscov_chan_hdr* hdr = chan.hdr;
+  while (!hdr->map_size) {
+    /* A far deadline, only so that signals wake us up. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 3600;
+    lscov_chan_wait(&hdr->map_size, 0, &hdr->d_sleeping, &hdr->d_spins,
+        &deadline);
+
+    if (stop_asked)
+      lscov_stop(0);
+  }
+
+  lstate_size = hdr->map_size;
+}
+
+u8 lscov_record(u8* map, struct lscov_chan_slot* slot, pid_t producer) {
+  /* Bucketize the hit counts, making a logic state (per bucketing). */
+  for (u32 i = 0; i < num_views; i++)
+    if (!views[i].shares_lstate)
+      hcount_bucket_to_lstate(views[i].bucket, views[i].lstate, map);
+
+  /* Done with the map; let the slot go as early as possible. */
+  if (slot)
+    hcount_mark_read(slot);
+
+  u8 is_new = 0;
+  for (u32 i = 0; i < num_views; i++) {
+    u8 view_new = view_update(&views[i]);
+    if (!i)
+      is_new = view_new;
+  }
+
+  if (cms)
+    cms_update(views[0].fp, is_new);
+  if (topk)
+    topk_update(views[0].fp, views[0].lstate);
+  if (evlog_ring)
+    evlog_push(producer, views[0].fp, is_new);
+
+  return is_new;
 }
 
-/* Debug */
-void sem_print_val(const char *when) {
-  int _sema_rd_val;
-  int _sema_dr_val;
-  sem_getvalue(sema_rd, &_sema_rd_val);
-  sem_getvalue(sema_dr, &_sema_dr_val);
-  SAYF("[%s] rd:%d, dr:%d\n", when, _sema_rd_val, _sema_dr_val);
+static struct producer* producer_get(pid_t pid) {
+  /* Consecutive executions mostly come from the same producer. */
+  if (producers[last_producer].pid == pid)
+    return &producers[last_producer];
+
+  u32 victim = 0;
+  for (u32 i = 0; i < PRODUCERS_MAX; i++) {
+    if (producers[i].pid == pid) {
+      last_producer = i;
+      return &producers[i];
+    }
+    if (producers[i].last_seen < producers[victim].last_seen)
+      victim = i;
+  }
+
+  producers[victim] = (struct producer){ .pid = pid };
+  last_producer = victim;
+  return &producers[victim];
+}
+
+void lscov_stop(int sig) {
+  /* From the loop (or before it), never from a handler: the last row takes
+   * locks. */
+  ACTF("Terminating lscov...");
+  stop_soon = 1;
+  lscov_report(NULL);
+  OKF("Good luck! %s", random_emoji());
+
+  exit(0);
+}
+
+void lscov_ask_stop(int sig) {
+  stop_asked = 1;
 }
-/* Debug */
 
 void lscov_loop() {
   while (1) {
-    int sem_rd_ret = hcount_wait_until_ready(); 
-
-    /* Update the filter. */
-    if (!sem_rd_ret) {
-      exec_count++;
-      exec_count_in_period++;
+    if (unlikely(stop_asked))
+      lscov_stop(0);
+
+    /* Not much left to find; take the fuzzer down with us (if ours). */
+    if (unlikely(saturated)) {
+      if (target_pid) {
+        signal(SIGCHLD, SIG_DFL);
+        kill(target_pid, SIGTERM);
+      }
+      lscov_stop(0);
+    }
 
-      /* Bucketize the hit counts, making a logic state. */
-      static u8* lstate;
-      if (!lstate)
-        lstate = mmap(0, LSTATE_SIZE, PROT_READ | PROT_WRITE, 
-            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u64 wait_start = timing_on ? lscov_now_ns() : 0;
+    int ready_ret = hcount_wait_until_ready();
+    if (timing_on && !ready_ret)
+      lscov_hist_add(&wait_hist, lscov_now_ns() - wait_start);
 
-      hcount_bucket_to_lstate(lstate);
-      hcount_mark_read();
+    /* Update the filter with every ready slot. */
+    for (u32 s = 0; !ready_ret && s < chan.hdr->num_slots; s++) {
+      struct lscov_chan_slot* slot = lscov_chan_slot(chan.hdr, s);
+      u32 state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+      if (state < LSCOV_SLOT_READY)
+        continue;
 
-      /* Set the hash indices of the logic state to 1 in the filter. */
-      for (int h = 0; h < num_hashes; h++) {
-        u32 hidx = bfilter_get_hash_index(lstate, h);
-        bfilter_set_1_by_index(hidx);
-      } 
+      u64 ingest_start = timing_on ? lscov_now_ns() : 0;
+      exec_count++;
+      exec_count_in_period++;
+      slot_execs[s]++;
+
+      pid_t producer = slot->producer;
+      struct producer* prod = producer_get(producer);
+      prod->execs++;
+      prod->last_seen = exec_count;
+
+      /* The producer wrote that; a bogus one (buggy, or stale) mustn't have
+       * us read past the slot. */
+      u32 status = state - LSCOV_SLOT_READY;
+      u32 num_maps = slot->num_threads ? slot->num_threads : 1;
+      u32 max_maps = LSTATE_SIZE_MAX / lstate_size;   // = map_size_max
+      if (unlikely(num_maps > max_maps)) {
+        num_maps = max_maps;
+        status = LSCOV_EXEC_CRASH;
+      }
+
+      switch (status) {
+      case LSCOV_EXEC_CRASH: crash_count++; prod->crashes++; break;
+      case LSCOV_EXEC_HANG:  hang_count++;  prod->hangs++;   break;
+      }
+
+      u8* map = lscov_chan_map(chan.hdr, s);
+
+      if (thread_mode == THREADS_PER) {
+        for (u32 t = 0; t < num_maps; t++)
+          prod->new_states += lscov_record(map + (u64)t * lstate_size, 
+              t == num_maps - 1 ? slot : NULL, producer);
+      } else {
+        if (thread_mode == THREADS_UNION && num_maps > 1)
+          hcount_union(map, num_maps);
+        prod->new_states += lscov_record(map, slot, producer);
+      }
+
+      if (timing_on)
+        lscov_hist_add(&ingest_hist, lscov_now_ns() - ingest_start);
     }
 
     /* Report the coverage. */
@@ -467,19 +1619,293 @@ void lscov_loop() {
        * cardinality between the "previous" and "next" true value. So we're
        * actually not losing anything by doing this. */
 
+      time_t tally_time = tally_update_next_time();
+
       pthread_t _pt_dummy;
-      pthread_create(&_pt_dummy, NULL, &lscov_report, NULL);
+      pthread_create(&_pt_dummy, NULL, &lscov_report_thread, 
+          (void *)(intptr_t)tally_time);
+      pthread_detach(_pt_dummy);
+    }
+
+    /* Heavy hitters on demand (not from the handler: stdio isn't
+     * async-signal-safe). */
+    if (unlikely(dump_soon)) {
+      dump_soon = 0;
+      if (topk)
+        topk_dump(time(NULL) - start_time);
     }
   }
 }
 
-void lscov_stop(int sig) {
-  ACTF("Terminating lscov...");
-  stop_soon = 1;
-  lscov_report(NULL);
-  OKF("Good luck! %s", random_emoji());
+void lscov_dump(int sig) {
+  dump_soon = 1;
+}
 
-  exit(0);
+
+/* Control socket: one command per line, each answered with lines of its own
+ * and an empty line. Clients are served one at a time, by a thread of its
+ * own, so a slow one never holds up measurement. */
+
+static void ctl_stats(FILE* out) {
+  struct lscov_chan_hdr* hdr = chan.hdr;
+  time_t now = time(NULL);
+  u32 lower, upper;
+  float density;
+  u32 cov = lscov_get_cov(&lower, &upper, &density);
+
+  u32 queued = 0, in_flight = 0;
+  for (u32 s = 0; s < hdr->num_slots; s++) {
+    u32 state = lscov_chan_slot(hdr, s)->state;
+    queued += state >= LSCOV_SLOT_READY;
+    in_flight += state == LSCOV_SLOT_BUSY;
+  }
+
+  time_t since = last_tally_time ? last_tally_time : start_time;
+  fprintf(out, "time %lu\n", start_time ? now - start_time : 0);
+  fprintf(out, "coverage %u\n", cov);
+  if (error_percent > 0)
+    fprintf(out, "coverage_lower %u\ncoverage_upper %u\n", lower, upper);
+  fprintf(out, "density %.2f\n", density);
+  fprintf(out, "execs %u\n", exec_count);
+  fprintf(out, "exec_rate %.1f\n", start_time && now > since ? 
+      (double)exec_count_in_period / (now - since) : 0.0);
+  fprintf(out, "total %lu\n", hdr->exec_tick);
+  fprintf(out, "dropped %lu\n", hdr->dropped);
+  fprintf(out, "crashes %u\n", crash_count);
+  fprintf(out, "hangs %u\n", hang_count);
+  fprintf(out, "queued %u\n", queued);
+  fprintf(out, "in_flight %u\n", in_flight);
+  fprintf(out, "period %lu\n", tallying_period);
+  fprintf(out, "next_tally %ld\n", start_time ? next_tallying_time - now : -1);
+  if (evlog_ring)
+    fprintf(out, "events %lu\nevents_dropped %lu\n", evlog_tail, 
+        evlog_dropped);
+
+  /* Most recent first. Doesn't stop the loop; an entry may be replaced
+   * while we're at it. */
+  u8 listed[PRODUCERS_MAX] = {0};
+  for (u32 n = 0; n < PRODUCERS_MAX; n++) {
+    u32 latest = PRODUCERS_MAX;
+    for (u32 i = 0; i < PRODUCERS_MAX; i++)
+      if (!listed[i] && producers[i].pid && (latest == PRODUCERS_MAX || 
+            producers[i].last_seen > producers[latest].last_seen))
+        latest = i;
+    if (latest == PRODUCERS_MAX)
+      break;
+
+    struct producer p = producers[latest];
+    listed[latest] = 1;
+    fprintf(out, "producer %d execs %u crashes %u hangs %u new %u\n", 
+        p.pid, p.execs, p.crashes, p.hangs, p.new_states);
+  }
+}
+
+static void ctl_slots(FILE* out) {
+  /* Per-slot counters: in the non-blocking mode, one slot per execution in
+   * flight, so a lane of its own. */
+  struct lscov_chan_hdr* hdr = chan.hdr;
+  for (u32 s = 0; s < hdr->num_slots; s++) {
+    struct lscov_chan_slot* slot = lscov_chan_slot(hdr, s);
+    u32 state = slot->state;
+    fprintf(out, "%u %s %u %lu\n", s, 
+        state >= LSCOV_SLOT_READY ? "ready" : 
+        state == LSCOV_SLOT_BUSY ? "busy" : "free", slot->producer, 
+        slot_execs[s]);
+  }
+}
+
+static void ctl_command(char* line, FILE* out) {
+  char* cmd = strtok(line, " \t\r\n");
+  char* arg = strtok(NULL, " \t\r\n");
+
+  if (!cmd) {
+    return;
+  } else if (!strcmp(cmd, "stats")) {
+    ctl_stats(out);
+  } else if (!strcmp(cmd, "slots")) {
+    ctl_slots(out);
+  } else if (!strcmp(cmd, "tally") || !strcmp(cmd, "checkpoint")) {
+    if (!start_time) {
+      fprintf(out, "error not recording yet\n");
+    } else {
+      lscov_report((void *)(intptr_t)time(NULL));
+
+      /* Everything so far on disk, should the host go down next. */
+      if (!strcmp(cmd, "checkpoint")) {
+        fsync(fileno(out_csv));
+        fsync(fileno(out_series));
+      }
+      fprintf(out, "ok\n");
+    }
+  } else if (!strcmp(cmd, "period")) {
+    time_t period = arg ? atoi(arg) : 0;
+    if (period <= 0) {
+      fprintf(out, "error bad period (1 second or more)\n");
+    } else {
+      __atomic_store_n(&new_period, period, __ATOMIC_RELEASE);
+      fprintf(out, "ok\n");
+    }
+  } else if (!strcmp(cmd, "top")) {
+    if (!topk) {
+      fprintf(out, "error no heavy hitters (-k)\n");
+    } else {
+      u32 now = start_time ? time(NULL) - start_time : 0;
+      topk_dump(now);
+      topk_print(out, now);
+    }
+  } else {
+    fprintf(out, "error unknown command '%s' (stats, slots, tally, "
+        "checkpoint, period <sec>, top)\n", cmd);
+  }
+}
+
+static void* ctl_serve(void* _unused) {
+  thread_block_signals();
+
+  while (1) {
+    int fd = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      PFATAL("accept() failed");
+    }
+
+    /* Don't let a quiet client keep the others waiting. */
+    struct timeval tv = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    FILE* in = fdopen(fd, "r");
+    FILE* out = fdopen(dup(fd), "w");
+    char line[256];
+
+    while (in && out && fgets(line, sizeof(line), in)) {
+      ctl_command(line, out);
+      fprintf(out, "\n");
+      fflush(out);
+    }
+
+    if (out)
+      fclose(out);
+    if (in)
+      fclose(in);
+    else
+      close(fd);
+  }
+
+  return NULL;
+}
+
+void ctl_stop() {
+  unlink(ctl_path);
+}
+
+void ctl_init() {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(ctl_path) >= sizeof(addr.sun_path))
+    FATAL("control socket path too long (max: %lu)", 
+        sizeof(addr.sun_path) - 1);
+  strcpy(addr.sun_path, ctl_path);
+
+  /* Not for the fuzzer to inherit. */
+  ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (ctl_fd < 0)
+    PFATAL("socket() failed");
+
+  unlink(ctl_path);
+  if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    PFATAL("cannot bind to '%s'", ctl_path);
+  if (listen(ctl_fd, 16))
+    PFATAL("listen() failed");
+  atexit(ctl_stop);
+
+  if (pthread_create(&ctl_thread, NULL, ctl_serve, NULL))
+    PFATAL("cannot start the control socket server");
+  pthread_detach(ctl_thread);
+
+  ACTF("Control socket: %s", ctl_path);
+}
+
+
+static void* metrics_serve(void* _unused) {
+  /* Any request gets the metrics; HTTP/1.0 style, one per connection. */
+  thread_block_signals();
+
+  while (1) {
+    int fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      PFATAL("accept() failed");
+    }
+
+    struct timeval tv = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    char req[4096];
+    if (read(fd, req, sizeof(req)) <= 0) {
+      close(fd);
+      continue;
+    }
+
+    char* body;
+    size_t body_size;
+    FILE* out = open_memstream(&body, &body_size);
+    metrics_print(out, 1);
+    fclose(out);
+
+    dprintf(fd, "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/openmetrics-text; version=1.0.0; "
+        "charset=utf-8\r\n"
+        "Content-Length: %lu\r\nConnection: close\r\n\r\n", body_size);
+    /* A client gone by now is none of our business. */
+    ssize_t sent = write(fd, body, body_size);
+    (void)sent;
+
+    free(body);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+void metrics_init() {
+  metrics_on = 1;
+
+  /* A number is a port, anything else a file. */
+  char* end;
+  long port = strtol(metrics_spec, &end, 10);
+  if (*end) {
+    if (asprintf(&metrics_tmp_path, "%s.tmp", metrics_spec) < 0)
+      PFATAL("asprintf() failed.");
+    ACTF("Metrics: %s (at every tally)", metrics_spec);
+    return;
+  }
+  if (port <= 0 || port > 65535)
+    FATAL("bad metrics port (1 to 65535)");
+  metrics_port = port;
+
+  /* Localhost only; put a proxy in front for anything else. */
+  struct sockaddr_in addr = { .sin_family = AF_INET,
+    .sin_port = htons(metrics_port), 
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  int one = 1;
+
+  metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (metrics_fd < 0)
+    PFATAL("socket() failed");
+  setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)))
+    PFATAL("cannot bind to port %u", metrics_port);
+  if (listen(metrics_fd, 16))
+    PFATAL("listen() failed");
+
+  if (pthread_create(&metrics_thread, NULL, metrics_serve, NULL))
+    PFATAL("cannot start the metrics server");
+  pthread_detach(metrics_thread);
+
+  ACTF("Metrics: http://127.0.0.1:%u/metrics", metrics_port);
 }
 
 
@@ -488,15 +1914,102 @@ void arg_parse(int argc, char** argv) {
    * https://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html */
 
   int c;
+  u8 bfilter_size_set = 0;
 
   opterr = 0;
 
-  while ((c = getopt (argc, argv, "o:")) != -1) {
+  /* Stop at the first non-option, which starts the fuzzer command line. */
+  while ((c = getopt (argc, argv, "+o:c:n:Nr:t:b:v:f:k:S:e:m:gls:M:L")) != -1) {
     switch (c) {
     case 'o':
       out_path = optarg;
       ACTF("Output path: %s", out_path);
       break;
+    case 'c':
+      chan_name = optarg;
+      break;
+    case 'n':
+      num_slots = atoi(optarg);
+      if (!num_slots || num_slots > LSCOV_SLOTS_MAX)
+        FATAL("bad number of slots (1 to %u)", LSCOV_SLOTS_MAX);
+      break;
+    case 'N':
+      chan_flags |= LSCOV_CHAN_NONBLOCK;
+      break;
+    case 'r':
+      sample_rate = atoi(optarg);
+      if (!sample_rate)
+        FATAL("bad sampling rate (1 or more)");
+      break;
+    case 't':
+      if (!strcmp(optarg, "per"))
+        thread_mode = THREADS_PER;
+      else if (!strcmp(optarg, "union"))
+        thread_mode = THREADS_UNION;
+      else
+        FATAL("bad thread mode '%s' (per or union)", optarg);
+      chan_flags |= LSCOV_CHAN_THREADS;
+      ACTF("Per-thread logic states: %s", optarg);
+      break;
+    case 'b':
+      bucket = lscov_bucket_find(optarg);
+      if (!bucket) {
+        SAYF("Bucketing schemes:\n");
+        for (u32 i = 0; i < NUM_BUCKETS; i++)
+          SAYF("    %-16s %s\n", lscov_buckets[i].name, lscov_buckets[i].desc);
+        FATAL("bad bucketing scheme '%s'", optarg);
+      }
+      break;
+    case 'v':
+      view_specs = optarg;
+      break;
+    case 'e': {
+      int percent = atoi(optarg);
+      if (percent < 1 || percent > 99)
+        FATAL("bad error rate for the bounds (1 to 99%%)");
+      error_percent = percent;
+      error_z = bfilter_calc_z(error_percent);
+      ACTF("Error bounds: %u%% confidence", 100 - error_percent);
+      break;
+    }
+    case 'm':
+      bfilter_size = atoi(optarg);
+      if (!bfilter_size || bfilter_size > 256)
+        FATAL("bad Bloom filter size (1 to 256 MiB)");
+      bfilter_size <<= 20;
+      bfilter_size_set = 1;
+      break;
+    case 'g':
+      sbf_mode = 1;
+      break;
+    case 'l':
+      evlog_mode = 1;
+      break;
+    case 's':
+      ctl_path = optarg;
+      break;
+    case 'M':
+      metrics_spec = optarg;
+      break;
+    case 'L':
+      latency_mode = 1;
+      break;
+    case 'S':
+      stop_pnew = atof(optarg);
+      if (stop_pnew <= 0 || stop_pnew >= 1)
+        FATAL("bad P(new) to stop at (between 0 and 1)");
+      break;
+    case 'k':
+      topk_size = atoi(optarg);
+      if (!topk_size)
+        FATAL("bad number of heavy hitters (1 or more)");
+      topk_out = 1;
+      break;
+    case 'f':
+      cms_size_kb = atoi(optarg);
+      if (!cms_size_kb)
+        FATAL("bad frequency sketch size (1 KiB or more)");
+      break;
     case '?':
       WARNF("Ignoring -%c...", optopt);
       break;
@@ -505,24 +2018,99 @@ void arg_parse(int argc, char** argv) {
     }
   }
 
-  /* In case lscov requires non-option arguments in the future... */
-  // for (index = optind; index < argc; index++)
-  //   printf ("Non-option argument %s\n", argv[index]);
+  /* Only the non-blocking mode makes use of more slots. */
+  if (!(chan_flags & LSCOV_CHAN_NONBLOCK)) {
+    if (num_slots > 1)
+      WARNF("Ignoring -n without -N...");
+    num_slots = 1;
+  } else if (!num_slots) {
+    num_slots = 4;
+  }
+
+  if (chan_flags & LSCOV_CHAN_NONBLOCK || sample_rate > 1)
+    ACTF("Sampling: %s, 1 in %u execution(s), %u slot(s)", 
+        chan_flags & LSCOV_CHAN_NONBLOCK ? "non-blocking" : "blocking",
+        sample_rate, num_slots);
+
+  /* Latencies (for the output, or the metrics) need the binary's, too. */
+  if (latency_mode || metrics_spec) {
+    timing_on = 1;
+    chan_flags |= LSCOV_CHAN_TIMING;
+  }
+
+  /* A growing filter had better start small (and cache-resident). The other
+   * views' filters don't grow, so they keep the full size. */
+  if (sbf_mode && bfilter_size_set)
+    sbf_size_init = bfilter_size;
+
+  /* The estimates need frequencies, and the top share heavy hitters. */
+  if (stop_pnew > 0 && !cms_size_kb)
+    cms_size_kb = CMS_SIZE_KB;
+  if (cms_size_kb && !topk_size)
+    topk_size = TOPK_SIZE;
+
+  /* The logic state under '-b' comes first, then the rest. */
+  num_views = 1;
+  views[0].kind = VIEW_LSTATE;
+  views[0].bucket = bucket;
+  snprintf(views[0].name, sizeof(views[0].name), "lstate:%s", bucket->name);
+
+  if (view_specs)
+    for (char* spec = strtok(view_specs, ","); spec; spec = strtok(NULL, ","))
+      view_add(spec);
+
+  /* Non-option arguments: the fuzzer to run under this daemon. */
+  if (optind < argc)
+    target_argv = argv + optind;
 
   return;
 }
 
 
+void target_reap(int sig) {
+  /* The fuzzer is gone, and so is the point of measuring. */
+  int status;
+  if (waitpid(target_pid, &status, WNOHANG) == target_pid)
+    stop_asked = 1;
+}
+
+void target_spawn() {
+  struct sigaction sa;
+  sa.sa_handler = target_reap;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+
+  target_pid = fork();
+  if (target_pid < 0)
+    PFATAL("fork() for the fuzzer failed");
+
+  if (!target_pid) {
+    execvp(target_argv[0], target_argv);
+
+    /* Not exit(): the channel is ours (parent's) to clean up. */
+    WARNF("cannot execute '%s' (%s)", target_argv[0], strerror(errno));
+    _exit(1);
+  }
+
+  OKF("Started the fuzzer. (pid: %d)", target_pid);
+}
+
+
 void sig_init() {
   /* Install cleanup handler. */
   struct sigaction sa;
-  sa.sa_handler = lscov_stop;
+  sa.sa_handler = lscov_ask_stop;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = 0;
 
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGHUP, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
+
+  /* Heavy hitters on demand. */
+  sa.sa_handler = lscov_dump;
+  sigaction(SIGUSR1, &sa, NULL);
 }
 
 
@@ -536,14 +2124,32 @@ int main(int argc, char** argv) {
   ACTF("Initializating...");
   lscov_init();
   sig_init();
-  out_init();
   hcount_init();
   bfilter_init();
+  if (cms_size_kb)
+    cms_init();
+  if (topk_size)
+    topk_init();
+  out_init();
+  if (evlog_mode)
+    evlog_init();
+  if (ctl_path)
+    ctl_init();
+  if (metrics_spec)
+    metrics_init();
+
+  /* Start the fuzzer ourselves, or tell the user how to. */
+  if (target_argv)
+    target_spawn();
+  else
+    OKF("Channel ready. (" cBRI "export %s=%s" cRST ")", LSCOV_CHAN_ENV, 
+        chan.path);
 
   /* Wait until when a fuzzer starts. */
   ACTF("Waiting for a fuzzer...");
   lscov_wait();
-  OKF("Fuzzer started.");
+  OKF("Fuzzer started. (logic state size: %'u bytes)", lstate_size);
+  view_init();
   
   /* Looping... */
   ACTF("Recording... (out: %s)", out_path);
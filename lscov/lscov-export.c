@@ -0,0 +1,43 @@
+/*
+ * lscov - time series exporter
+ * ----------------------------
+ *
+ * Turn a binary time series (lscov.csv.ts, see series.h) back into CSV, the
+ * same way the daemon writes lscov.csv.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stuff.h"
+#include "series.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    SAYF("Usage: %s <time series> [<CSV out>]\n", argv[0]);
+    exit(1);
+  }
+
+  u64 file_size;
+  const struct lscov_series_hdr* hdr = lscov_series_map(argv[1], &file_size);
+
+  FILE* fout = stdout;
+  if (argc > 2 && !(fout = fopen(argv[2], "w")))
+    PFATAL("cannot open '%s'", argv[2]);
+
+  lscov_series_print_header(fout, hdr->fields, hdr->num_fields);
+
+  u64 num_records = lscov_series_num_records(hdr, file_size);
+  for (u64 i = 0; i < num_records; i++)
+    lscov_series_print_record(fout, hdr->fields, hdr->num_fields,
+        lscov_series_record(hdr, i));
+
+  if (fout != stdout)
+    fclose(fout);
+
+  return 0;
+}
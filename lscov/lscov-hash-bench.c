@@ -0,0 +1,593 @@
+/*
+ * lscov - hash benchmark
+ * ----------------------
+ *
+ * Which hash should turn logic states into Bloom filter indices and
+ * fingerprints. For every candidate (see hash.h, plus xxh3 from AFL++'s
+ * xxhash.h): how long it takes per logic state, the way the daemon would use
+ * it, and whether it's good enough. That means indices spread evenly over the
+ * filter, no fingerprint collisions, one flipped bit flipping half the
+ * fingerprint, and the false positive rate the filter should have.
+ *
+ * Logic states are real ones, captured from a binary beforehand (-c), or
+ * sparse synthetic ones.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "stuff.h"
+#include "channel.h"
+#include "bucket.h"
+#include "hash.h"
+#include "hist.h"
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+/* Captured maps: a header, then raw hit count maps back to back. */
+
+#define MAPS_MAGIC        "LSCOVMP"
+#define MAPS_VERSION      1
+
+struct maps_hdr {
+  char        magic[8];           // MAPS_MAGIC
+  u32         version;            // MAPS_VERSION
+  u32         map_size;           // Bytes per map
+};
+
+#define CHI_BINS          1024
+#define AVAL_STATES       256     // Logic states to flip bits of...
+#define AVAL_FLIPS        32      // ... this many times each
+#define BLOOM_BITS        6       // Filter bits per logic state (FPR test)
+#define QUALITY_STATES_MIN 1024   // Fewer: the figures are mostly noise
+
+/* Parameters */
+
+u32         map_size = LSTATE_SIZE;    // Map size, in bytes (synthetic)
+u32         num_maps = 2048;           // Maps to test with (or capture)
+double      density = 0.01;            // Share of the map hit (synthetic)
+u32         num_hashes = 4;            // Filter indices per logic state
+u32         bfilter_size_bits = 0x4000000 << 3;   // Daemon's filter, in bits
+u32         rounds = 5;                // Timing rounds (best one counts)
+struct lscov_bucket* bucket = lscov_buckets;       // Bucketing scheme
+const char* capture_path = NULL;       // Capture to (NULL: benchmark)
+
+u8*         states;                    // Distinct logic states
+u32         num_states;
+
+/* Candidates. A 32-bit hash is called once per index with the index as the
+ * seed, as the daemon does; a 64-bit one once, for all indices. */
+
+struct candidate {
+  const char* name;
+  u8          bits;
+  u64         (*fn)(const u8*, u32);
+  const char* kernel;
+};
+
+struct lscov_ml_key ml_key;
+lscov_ml_fn ml_fn;
+
+static u64 cand_murmur3(const u8* l, u32 seed) {
+  return lscov_hash_murmur3(l, map_size, seed);
+}
+
+#ifdef LSCOV_HASH_X86
+static u64 cand_crc32c(const u8* l, u32 seed) {
+  return lscov_hash_crc32c(l, map_size, seed);
+}
+#endif
+
+static u64 cand_xxh3(const u8* l, u32 seed) {
+  return XXH3_64bits_withSeed(l, map_size, seed);
+}
+
+static u64 cand_multilinear(const u8* l, u32 seed) {
+  return ml_fn(&ml_key, l);
+}
+
+static struct candidate candidates[4];
+static u32 num_candidates;
+
+static void candidates_init() {
+  candidates[num_candidates++] = (struct candidate){
+    "murmur3", 32, cand_murmur3, "scalar" };
+
+#ifdef LSCOV_HASH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2"))
+    candidates[num_candidates++] = (struct candidate){
+      "crc32c", 64, cand_crc32c, "sse4.2" };
+  else
+    WARNF("No SSE4.2; skipping crc32c.");
+#endif
+
+  /* xxh3 picks its vector unit at compile time. */
+  static const char* xxh_vectors[] = {
+    "scalar", "sse2", "avx2", "avx512", "neon", "vsx" };
+  candidates[num_candidates++] = (struct candidate){
+    "xxh3", 64, cand_xxh3, xxh_vectors[XXH_VECTOR] };
+
+  const char* kernel;
+  lscov_ml_key_init(&ml_key, map_size, 0x6c73636f76ULL);
+  ml_fn = lscov_hash_ml_select(&kernel);
+  candidates[num_candidates++] = (struct candidate){
+    "multilinear", 64, cand_multilinear, kernel };
+}
+
+/* Indices (into a filter of 'size_bits') and fingerprint of a logic state,
+ * the way the daemon would take them. */
+
+static inline u64 cand_hash(const struct candidate* c, const u8* l,
+    u32* idx, u32 size_bits) {
+  if (c->bits == 32) {
+    u32 hash[2] = { 0, 0 };
+    for (u32 h = 0; h < num_hashes; h++) {
+      u32 hval = c->fn(l, h);
+      idx[h] = hval % size_bits;
+      if (h < 2)
+        hash[h] = hval;
+    }
+    if (num_hashes < 2)
+      hash[1] = c->fn(l, 1);
+
+    return ((u64)hash[0] << 32) | hash[1];
+  }
+
+  u64 fp = c->fn(l, 0);
+  for (u32 h = 0; h < num_hashes; h++)
+    idx[h] = lscov_hash_index(fp, h, size_bits);
+  return fp;
+}
+
+
+/* Logic states */
+
+static inline u64 splitmix64(u64* x) {
+  u64 z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void states_alloc(u32 n) {
+  states = mmap(0, (u64)n * map_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (states == MAP_FAILED)
+    PFATAL("cannot allocate %u logic states", n);
+}
+
+static void states_add(const u8* hit_counts) {
+  /* Bucketed, as the daemon hashes them. */
+  u8* l = states + (u64)num_states++ * map_size;
+  if (!bucket->num_steps)
+    memcpy(l, hit_counts, map_size);
+  else
+    lscov_bucket_scalar(bucket, l, hit_counts, map_size);
+}
+
+static void states_synth() {
+  u8* map = malloc(map_size);
+  u32 hits = density * map_size;
+  u64 rng = 0x6c73636f76ULL;
+
+  states_alloc(num_maps);
+  for (u32 i = 0; i < num_maps; i++) {
+    memset(map, 0, map_size);
+    for (u32 j = 0; j < (hits ? hits : 1); j++) {
+      u64 r = splitmix64(&rng);
+      map[(r >> 32) % map_size] = 1 + (r & 15);
+    }
+    states_add(map);
+  }
+
+  free(map);
+}
+
+static void states_load(char** paths, u32 num_paths) {
+  u8* map = NULL;
+
+  for (u32 p = 0; p < num_paths; p++) {
+    FILE* f = fopen(paths[p], "rb");
+    struct maps_hdr hdr;
+    if (!f)
+      PFATAL("cannot open '%s'", paths[p]);
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, MAPS_MAGIC, 8) || hdr.version != MAPS_VERSION ||
+        !hdr.map_size || hdr.map_size % LSTATE_ALIGN ||
+        hdr.map_size > LSTATE_SIZE_MAX)
+      FATAL("'%s' isn't a map capture", paths[p]);
+
+    if (!map) {
+      map_size = hdr.map_size;
+      map = malloc(map_size);
+      states_alloc(num_maps);
+    } else if (hdr.map_size != map_size) {
+      FATAL("'%s' has %u-byte maps (not %u)", paths[p], hdr.map_size,
+          map_size);
+    }
+
+    while (num_states < num_maps && fread(map, map_size, 1, f) == 1)
+      states_add(map);
+    fclose(f);
+  }
+
+  free(map);
+}
+
+struct state_key {
+  XXH128_hash_t hash;
+  u32           i;
+};
+
+static int state_key_cmp(const void* _a, const void* _b) {
+  const struct state_key *a = _a, *b = _b;
+  if (a->hash.high64 != b->hash.high64)
+    return a->hash.high64 < b->hash.high64 ? -1 : 1;
+  if (a->hash.low64 != b->hash.low64)
+    return a->hash.low64 < b->hash.low64 ? -1 : 1;
+  return a->i < b->i ? -1 : a->i > b->i;
+}
+
+static void states_dedup() {
+  /* The same logic state over and over says nothing about a hash. */
+  struct state_key* keys = malloc(num_states * sizeof(struct state_key));
+  for (u32 i = 0; i < num_states; i++) {
+    keys[i].hash = XXH3_128bits(states + (u64)i * map_size, map_size);
+    keys[i].i = i;
+  }
+  qsort(keys, num_states, sizeof(struct state_key), state_key_cmp);
+
+  u8* keep = calloc(num_states, 1);
+  for (u32 i = 0; i < num_states; i++)
+    keep[keys[i].i] = !i || !XXH128_isEqual(keys[i].hash, keys[i - 1].hash) ||
+      memcmp(states + (u64)keys[i].i * map_size,
+          states + (u64)keys[i - 1].i * map_size, map_size);
+
+  u32 n = 0;
+  for (u32 i = 0; i < num_states; i++)
+    if (keep[i] && n++ != i)
+      memcpy(states + (u64)(n - 1) * map_size, states + (u64)i * map_size,
+          map_size);
+
+  if (n < num_states)
+    ACTF("%u duplicate logic state(s) left out.", num_states - n);
+  num_states = n;
+
+  free(keep);
+  free(keys);
+}
+
+
+/* Measurements */
+
+static double time_ns(const struct candidate* c) {
+  /* Per logic state, hot in the cache as the daemon's just bucketed it. */
+  u8* l = malloc(map_size);
+  u32 idx[64];
+  volatile u64 sink = 0;
+
+  u64 clock_ns = lscov_now_ns();
+  for (u32 i = 0; i < 1000; i++)
+    lscov_now_ns();
+  clock_ns = (lscov_now_ns() - clock_ns) / 1001;
+
+  double best = 0;
+  for (u32 r = 0; r < rounds; r++) {
+    u64 total_ns = 0;
+    for (u32 i = 0; i < num_states; i++) {
+      memcpy(l, states + (u64)i * map_size, map_size);
+      u64 start_ns = lscov_now_ns();
+      sink += cand_hash(c, l, idx, bfilter_size_bits);
+      total_ns += lscov_now_ns() - start_ns - clock_ns;
+    }
+
+    double ns = (double)total_ns / num_states;
+    if (!r || ns < best)
+      best = ns;
+  }
+
+  free(l);
+  return best;
+}
+
+static double chi2(const u32* bins, u64 total) {
+  double expected = (double)total / CHI_BINS, sum = 0;
+  for (u32 b = 0; b < CHI_BINS; b++)
+    sum += (bins[b] - expected) * (bins[b] - expected) / expected;
+  return sum / (CHI_BINS - 1);
+}
+
+static int u64_cmp(const void* _a, const void* _b) {
+  u64 a = *(const u64 *)_a, b = *(const u64 *)_b;
+  return a < b ? -1 : a > b;
+}
+
+static void bench(const struct candidate* c) {
+  u32 idx[64];
+  u64* fps = malloc(num_states * sizeof(u64));
+
+  /* Index spread: the top and the bottom bits of the index. */
+  static u32 top[CHI_BINS], low[CHI_BINS];
+  memset(top, 0, sizeof(top));
+  memset(low, 0, sizeof(low));
+
+  for (u32 i = 0; i < num_states; i++) {
+    fps[i] = cand_hash(c, states + (u64)i * map_size, idx, bfilter_size_bits);
+    for (u32 h = 0; h < num_hashes; h++) {
+      top[(u64)idx[h] * CHI_BINS / bfilter_size_bits]++;
+      low[idx[h] % CHI_BINS]++;
+    }
+  }
+
+  u64 total = (u64)num_states * num_hashes;
+  double chi_top = chi2(top, total), chi_low = chi2(low, total);
+  double chi = chi_top > chi_low ? chi_top : chi_low;
+
+  /* Fingerprint collisions: whole, and of the top half (for the birthday
+   * bound to say something at this scale). */
+  qsort(fps, num_states, sizeof(u64), u64_cmp);
+  u64 coll64 = 0, coll32 = 0, run = 1;
+  for (u32 i = 1; i <= num_states; i++) {
+    if (i < num_states && fps[i] == fps[i - 1])
+      coll64++;
+    if (i < num_states && fps[i] >> 32 == fps[i - 1] >> 32) {
+      run++;
+    } else {
+      coll32 += run * (run - 1) / 2;
+      run = 1;
+    }
+  }
+  double coll32_exp = (double)num_states * (num_states - 1) / 2 / 4294967296.0;
+
+  /* Avalanche: flip a bit anywhere, see what the fingerprint makes of it. */
+  u8* l = malloc(map_size);
+  u32 flips[64] = { 0 };
+  u32 trials = 0;
+  u64 rng = 0x617661ULL;
+
+  for (u32 i = 0; i < num_states && i < AVAL_STATES; i++) {
+    memcpy(l, states + (u64)i * map_size, map_size);
+    u64 fp = cand_hash(c, l, idx, bfilter_size_bits);
+
+    for (u32 t = 0; t < AVAL_FLIPS; t++) {
+      u64 r = splitmix64(&rng);
+      u32 pos = (r >> 8) % map_size;
+      l[pos] ^= 1 << (r & 7);
+      u64 diff = fp ^ cand_hash(c, l, idx, bfilter_size_bits);
+      l[pos] ^= 1 << (r & 7);
+
+      for (u32 b = 0; b < 64; b++)
+        flips[b] += (diff >> b) & 1;
+      trials++;
+    }
+  }
+
+  double aval = 0, bias = 0;
+  for (u32 b = 0; b < 64; b++) {
+    double p = (double)flips[b] / trials;
+    aval += p / 64;
+    if (fabs(p - 0.5) > bias)
+      bias = fabs(p - 0.5);
+  }
+
+  /* False positives: half of the logic states in a small filter, the other
+   * half looked up. */
+  u32 half = num_states / 2;
+  u32 size_bits = half * BLOOM_BITS;
+  u8* filter = calloc((size_bits >> 3) + 1, 1);
+  u32 fp_count = 0;
+
+  for (u32 i = 0; i < half; i++) {
+    cand_hash(c, states + (u64)i * map_size, idx, size_bits);
+    for (u32 h = 0; h < num_hashes; h++)
+      filter[idx[h] >> 3] |= 1 << (idx[h] & 7);
+  }
+  for (u32 i = half; i < 2 * half; i++) {
+    cand_hash(c, states + (u64)i * map_size, idx, size_bits);
+    u32 h = 0;
+    while (h < num_hashes && (filter[idx[h] >> 3] & (1 << (idx[h] & 7))))
+      h++;
+    fp_count += h == num_hashes;
+  }
+
+  double fpr = half ? (double)fp_count / half : 0;
+  double fpr_exp = pow(1 - exp(-(double)num_hashes / BLOOM_BITS), num_hashes);
+  double fpr_sigma = half ? sqrt(fpr_exp * (1 - fpr_exp) / half) : 0;
+
+  double ns = time_ns(c);
+
+  u8 ok = chi < 1.25 && !coll64 && fabs(aval - 0.5) < 0.01 && bias < 0.05 &&
+    fabs(fpr - fpr_exp) <= 4 * fpr_sigma;
+
+  SAYF("%-12s %-7s %10.1f %7.2f %8.3f %7lu %7lu %7.1f %8.4f %7.4f "
+      "%6.2f%% %6.2f%%  %s\n", c->name, c->kernel, ns, map_size / ns,
+      chi, coll64, coll32, coll32_exp, aval, bias, fpr * 100, fpr_exp * 100,
+      ok ? cLGN "ok" cRST : cLRD "poor" cRST);
+
+  free(filter);
+  free(l);
+  free(fps);
+}
+
+
+/* Capture */
+
+static void capture(char** target_argv) {
+  struct lscov_chan ch;
+  lscov_chan_create(&ch, NULL, LSTATE_SIZE_MAX, 1, 0, 1);
+  setenv(LSCOV_CHAN_ENV, ch.path, 1);
+
+  FILE* out = fopen(capture_path, "wb");
+  if (!out)
+    PFATAL("cannot open '%s'", capture_path);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    PFATAL("fork() for the binary failed");
+  if (!pid) {
+    execvp(target_argv[0], target_argv);
+    PFATAL("cannot execute '%s'", target_argv[0]);
+  }
+
+  /* The daemon's loop, minus everything but keeping the maps. */
+  struct lscov_chan_hdr* hdr = ch.hdr;
+  struct lscov_chan_slot* slot = lscov_chan_slot(hdr, 0);
+  u32 seq_read = 0, captured = 0;
+
+  while (captured < num_maps) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    if (lscov_chan_wait(&hdr->seq_done, seq_read, &hdr->d_sleeping,
+          &hdr->d_spins, &deadline)) {
+      if (waitpid(pid, NULL, WNOHANG) == pid) {
+        pid = 0;
+        break;
+      }
+      continue;
+    }
+
+    seq_read = __atomic_load_n(&hdr->seq_done, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) < LSCOV_SLOT_READY)
+      continue;
+
+    if (!captured) {
+      struct maps_hdr mh = { MAPS_MAGIC, MAPS_VERSION, hdr->map_size };
+      if (fwrite(&mh, sizeof(mh), 1, out) != 1)
+        PFATAL("cannot write '%s'", capture_path);
+    }
+    if (fwrite(lscov_chan_map(hdr, 0), hdr->map_size, 1, out) != 1)
+      PFATAL("cannot write '%s'", capture_path);
+    captured++;
+
+    slot->producer = 0;
+    lscov_chan_post(&slot->state, LSCOV_SLOT_FREE, &hdr->rt_sleeping);
+  }
+
+  if (pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+
+  fclose(out);
+  OKF("Captured %u map(s) of %u bytes to %s", captured, hdr->map_size,
+      capture_path);
+  lscov_chan_destroy(&ch);
+}
+
+
+static void usage(const char* argv0) {
+  SAYF("Usage: %s [options] [<map capture>...]\n"
+       "       %s -c <map capture> [-n maps] -- <binary> [args...]\n\n"
+       "    -n <maps>      maps to test with, or to capture (default: %u)\n"
+       "    -s <KiB>       synthetic map size (default: %u)\n"
+       "    -D <percent>   share of a synthetic map hit (default: %g)\n"
+       "    -b <scheme>    bucketing (default: %s)\n"
+       "    -k <hashes>    filter indices per logic state (default: %u)\n"
+       "    -m <MiB>       filter size, for the index spread (default: %u)\n"
+       "    -r <rounds>    timing rounds, the best one counting "
+       "(default: %u)\n",
+       argv0, argv0, num_maps, map_size >> 10, density * 100, bucket->name,
+       num_hashes, bfilter_size_bits >> 23, rounds);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  int c;
+  while ((c = getopt(argc, argv, "+n:s:D:b:k:m:r:c:")) != -1) {
+    switch (c) {
+    case 'n':
+      num_maps = atoi(optarg);
+      if (num_maps < 2)
+        FATAL("bad number of maps (2 or more)");
+      break;
+    case 's':
+      map_size = atoi(optarg) << 10;
+      if (map_size < (1 << 10) || map_size > LSTATE_SIZE_MAX)
+        FATAL("bad map size (1 to %u KiB)", LSTATE_SIZE_MAX >> 10);
+      break;
+    case 'D':
+      density = atof(optarg) / 100;
+      if (density <= 0 || density > 1)
+        FATAL("bad density (above 0, up to 100)");
+      break;
+    case 'b':
+      bucket = lscov_bucket_find(optarg);
+      if (!bucket)
+        FATAL("unknown bucketing scheme '%s'", optarg);
+      break;
+    case 'k':
+      num_hashes = atoi(optarg);
+      if (!num_hashes || num_hashes > 64)
+        FATAL("bad number of hashes (1 to 64)");
+      break;
+    case 'm': {
+      u32 mb = atoi(optarg);
+      if (!mb || mb > 511)
+        FATAL("bad filter size (1 to 511 MiB)");
+      bfilter_size_bits = mb << 23;
+      break;
+    }
+    case 'r':
+      rounds = atoi(optarg);
+      if (!rounds)
+        FATAL("bad number of rounds");
+      break;
+    case 'c':
+      capture_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (capture_path) {
+    if (optind >= argc)
+      usage(argv[0]);
+    capture(argv + optind);
+    return 0;
+  }
+
+  SAYF(cCYA "lscov-hash-bench v" VERSION cRST "\n");
+  lscov_bucket_init(bucket);
+
+  if (optind < argc)
+    states_load(argv + optind, argc - optind);
+  else
+    states_synth();
+  states_dedup();
+  if (num_states < 2)
+    FATAL("not enough logic states (%u)", num_states);
+  if (num_states < QUALITY_STATES_MIN)
+    WARNF("Only %u distinct logic states; take the quality figures with a "
+        "grain of salt.", num_states);
+
+  candidates_init();
+
+  ACTF("%u %s logic states of %u KiB (%s bucketing), %u indices into %u MiB",
+      num_states, optind < argc ? "captured" : "synthetic", map_size >> 10,
+      bucket->name, num_hashes, bfilter_size_bits >> 23);
+
+  SAYF("\n" cBRI "%-12s %-7s %10s %7s %8s %7s %7s %7s %8s %7s %7s %7s" cRST
+      "\n", "hash", "kernel", "ns/state", "GB/s", "chi2/df", "coll64",
+      "coll32", "(exp)", "avalnch", "bias", "fpr", "(exp)");
+  for (u32 i = 0; i < num_candidates; i++)
+    bench(&candidates[i]);
+
+  SAYF("\n(ok: chi2/df < 1.25, no 64-bit collisions, avalanche within 1%% of "
+      "0.5 and no bit biased by 5%%, FPR within 4 sigma)\n");
+  return 0;
+}
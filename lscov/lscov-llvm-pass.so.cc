@@ -1,14 +1,25 @@
 /*
  * lscov - logic state instrumtation
  * ---------------------------------
- * 
+ *
  * Mostly based on AFL. (https://github.com/google/AFL)
  * See "llvm_mode/afl-llvm-pass.so.cc" for the original implementation.
+ *
+ * The same plugin also runs at link time (LTO) when loaded by the linker.
+ * There it sees the whole program, so every branch outcome gets its own dense
+ * index and the map is exactly as large as the number of probes.
+ * See "instrumentation/SanitizerCoverageLTO.so.cc" in AFL++ for the idea.
  */
 
 #define USE_COLOR     // Yes, please.
 
+#include <set>
+#include <vector>
+
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
@@ -18,6 +29,8 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "stuff.h"
 
@@ -25,21 +38,37 @@ using namespace llvm;
 
 class LSCovPass : public PassInfoMixin<LSCovPass> {
 public:
+  LSCovPass(bool LTO = false)
+      : LTO(LTO), HitCounts(!getenv("LSCOV_NO_COUNTS")),
+        Threads(getenv("LSCOV_THREADS")) {}
+
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+
+private:
+  bool LTO;         // Running on the whole program at link time?
+  bool HitCounts;   // Count hits (or just mark them)?
+  bool Threads;     // Thread-local maps (for the LSCOV_THREADS runtime)?
+
+  GlobalVariable::ThreadLocalMode TLSModel() {
+    return Threads ? GlobalVariable::GeneralDynamicTLSModel
+                   : GlobalVariable::NotThreadLocal;
+  }
+
+  void insertMainHook(Module &M);
+  void exportMapSize(Module &M, u32 map_size);
+  void bumpCounter(Module &M, IRBuilder<> &IRB, Value *MapPtrIdx);
+  int instrumentEdges(Module &M);
+  int instrumentBranches(Module &M);
+  std::set<Function *> findReachable(Module &M);
 };
 
-PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
-  LLVMContext &C = M.getContext();
+/* Insert a call to '__lscov_main' at the beginning of 'main' (if any). */
 
-  IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
-  PointerType *Int8PtrTy = PointerType::get(Int8Ty, 0);
-  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+void LSCovPass::insertMainHook(Module &M) {
+  LLVMContext &C = M.getContext();
 
-  /* Show a banner */
-  //SAYF(cCYA "lscov-llvm-pass " cBRI VERSION cRST " by <iss300@gmail.com>\n");
-  
   Function *MainFn = M.getFunction("main");
-  if (MainFn) {
+  if (MainFn && !MainFn->isDeclaration()) {
     FunctionType *VoidVoidFTy = FunctionType::get(Type::getVoidTy(C), false);
     Value *LSCovMain = M.getOrInsertFunction("__lscov_main", VoidVoidFTy).getCallee();
 
@@ -49,14 +78,74 @@ PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
 
     IRB.CreateCall(VoidVoidFTy, LSCovMain);
   }
+}
+
+/* Record the map size this module needs in LSCOV_MAP_SIZE_SECTION. The
+ * runtime takes the largest of all modules and tells the daemon. */
+
+void LSCovPass::exportMapSize(Module &M, u32 map_size) {
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(M.getContext());
+
+  GlobalVariable *MapSize = new GlobalVariable(
+      M, Int32Ty, true, GlobalValue::PrivateLinkage,
+      ConstantInt::get(Int32Ty, map_size), "__lscov_map_size");
+  MapSize->setSection(LSCOV_MAP_SIZE_SECTION);
+  MapSize->setAlignment(Align(4));
+
+  appendToCompilerUsed(M, {MapSize});
+}
+
+/* Count a hit at 'MapPtrIdx', skipping zero on wrap-around (i.e., AFL++'s
+ * NeverZero) so that a visited location never reads as unvisited. The daemon
+ * buckets the counts into logic states. With LSCOV_NO_COUNTS, just mark. */
+
+void LSCovPass::bumpCounter(Module &M, IRBuilder<> &IRB, Value *MapPtrIdx) {
+  LLVMContext &C = M.getContext();
+  IntegerType *Int8Ty = IntegerType::getInt8Ty(C);
+
+  Value *Incr = ConstantInt::get(Int8Ty, 1);
+  if (HitCounts) {
+    LoadInst *Counter = IRB.CreateLoad(Int8Ty, MapPtrIdx);
+    Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Incr = IRB.CreateAdd(Counter, Incr);
+    Value *Wrapped = IRB.CreateICmpEQ(Incr, ConstantInt::get(Int8Ty, 0));
+    Incr = IRB.CreateAdd(Incr, IRB.CreateZExt(Wrapped, Int8Ty));
+  }
+
+  IRB.CreateStore(Incr, MapPtrIdx)
+      ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+}
 
-  /* Get globals for the SHM region and the previous location */
+/* Per-module instrumentation: AFL-style (prev_loc ^ cur_loc) with random
+ * IDs, at every block that doesn't end with an unconditional branch. */
+
+int LSCovPass::instrumentEdges(Module &M) {
+  LLVMContext &C = M.getContext();
+
+  IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
+  PointerType *Int8PtrTy = PointerType::get(Int8Ty, 0);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+
+  /* Get globals for the SHM region and the previous location. With
+   * LSCOV_THREADS, both are thread-local, so that threads can have their own
+   * maps. */
   GlobalVariable *LSCovMapPtr = new GlobalVariable(
-      M, Int8PtrTy, false, GlobalValue::ExternalLinkage, 0, "__lscov_area_ptr");
+      M, Int8PtrTy, false, GlobalValue::ExternalLinkage, 0, "__lscov_area_ptr",
+      0, TLSModel(), 0, false);
 
   GlobalVariable *LSCovPrevLoc = new GlobalVariable(
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__lscov_prev_loc",
-      0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
+      0, TLSModel(), 0, false);
+
+  /* Map size: LSTATE_SIZE unless asked otherwise (e.g., for huge targets). */
+  u32 map_size = LSTATE_SIZE;
+  if (getenv("LSCOV_MAP_SIZE_POW2")) {
+    u32 map_size_pow2 = atoi(getenv("LSCOV_MAP_SIZE_POW2"));
+    if (map_size_pow2 < 6 || map_size_pow2 > LSTATE_SIZE_MAX_POW2)
+      FATAL("LSCOV_MAP_SIZE_POW2 must be between 6 and %u",
+          LSTATE_SIZE_MAX_POW2);
+    map_size = 1 << map_size_pow2;
+  }
 
   /* Instrument all the things! */
   int inst_blocks = 0;
@@ -70,7 +159,7 @@ PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
       /* Skip this basic block if it terminates with an unconditional branch. */
       Instruction *TermI= BB.getTerminator();
       BranchInst *TermBrI= TermI ? dyn_cast<BranchInst>(TermI) : nullptr;
-      
+
       if (TermBrI&& TermBrI->isUnconditional())
         continue;
 
@@ -78,7 +167,7 @@ PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
       IRBuilder<> IRB(&(*IP));
 
       /* Make up cur_loc */
-      unsigned int cur_loc = RANDOM(LSTATE_SIZE);
+      unsigned int cur_loc = RANDOM(map_size);
       ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
 
       /* Load prev_loc */
@@ -89,22 +178,11 @@ PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
       /* Load SHM pointer */
       LoadInst *MapPtr = IRB.CreateLoad(Int8PtrTy, LSCovMapPtr);
       MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, 
+      Value *MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr,
           IRB.CreateXor(PrevLocCasted, CurLoc));
 
-#ifdef LSCOV_BUCKET
       /* Update bitmap */
-      LoadInst *Counter = IRB.CreateLoad(Int8Ty, MapPtrIdx);
-      Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-      IRB.CreateStore(Incr, MapPtrIdx)
-          ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-#else
-      /* Set bitmap */
-      Constant *ConstOne = ConstantInt::get(Int8Ty, 1);
-      IRB.CreateStore(ConstOne, MapPtrIdx)
-          ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-#endif
+      bumpCounter(M, IRB, MapPtrIdx);
 
       /* Set prev_loc to cur_loc >> 1 */
       StoreInst *Store =
@@ -115,11 +193,170 @@ PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
     }
   }
 
+  exportMapSize(M, map_size);
+
+  return inst_blocks;
+}
+
+/* Whole-program pruning: functions never reached from 'main' can't produce a
+ * logic state, so don't spend map entries on them. Anything whose address is
+ * taken (including constructors) may be called indirectly and counts as a
+ * root. Returns an empty set (i.e., no pruning) if there's no 'main'. */
+
+std::set<Function *> LSCovPass::findReachable(Module &M) {
+  std::set<Function *> reachable;
+  std::vector<Function *> worklist;
+
+  Function *MainFn = M.getFunction("main");
+  if (!MainFn || MainFn->isDeclaration())
+    return reachable;
+
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    if (&F == MainFn || F.hasAddressTaken())
+      worklist.push_back(&F);
+  }
+
+  while (!worklist.empty()) {
+    Function *F = worklist.back();
+    worklist.pop_back();
+
+    if (!reachable.insert(F).second)
+      continue;
+
+    for (auto &BB : *F)
+      for (auto &I : BB)
+        if (auto *CB = dyn_cast<CallBase>(&I))
+          if (Function *Callee = CB->getCalledFunction())
+            if (!Callee->isDeclaration() && !reachable.count(Callee))
+              worklist.push_back(Callee);
+  }
+
+  return reachable;
+}
+
+/* Whole-program instrumentation: every outcome of a conditional branch or a
+ * switch gets its own index, counting from 1 (0 is the start marker). No
+ * prev_loc is needed and no two outcomes share an entry. */
+
+int LSCovPass::instrumentBranches(Module &M) {
+  LLVMContext &C = M.getContext();
+
+  IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
+  PointerType *Int8PtrTy = PointerType::get(Int8Ty, 0);
+  IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+
+  GlobalVariable *LSCovMapPtr = new GlobalVariable(
+      M, Int8PtrTy, false, GlobalValue::ExternalLinkage, 0, "__lscov_area_ptr",
+      0, TLSModel(), 0, false);
+
+  std::set<Function *> reachable;
+  if (!getenv("LSCOV_NO_PRUNE"))
+    reachable = findReachable(M);
+
+  /* Collect the probe sites first, as splitting edges changes the CFG. */
+  std::vector<BranchInst *> branches;
+  std::vector<std::pair<Instruction *, unsigned>> switch_edges;
+  u32 pruned_funcs = 0;
+
+  for (auto &F : M) {
+    if (F.isDeclaration() || F.getName().contains("sancov") ||
+        F.getName().startswith("__lscov_"))
+      continue;
+
+    if (!reachable.empty() && !reachable.count(&F)) {
+      pruned_funcs++;
+      continue;
+    }
+
+    for (auto &BB : F) {
+      Instruction *TermI = BB.getTerminator();
+      if (!TermI)
+        continue;
+
+      if (auto *BrI = dyn_cast<BranchInst>(TermI)) {
+        if (BrI->isConditional())
+          branches.push_back(BrI);
+      } else if (auto *SwI = dyn_cast<SwitchInst>(TermI)) {
+        for (unsigned s = 0; s < SwI->getNumSuccessors(); s++)
+          switch_edges.push_back({SwI, s});
+      }
+    }
+  }
+
+  u32 next_id = 1;
+  auto makeIdx = [&](u32 id) -> u32 {
+    /* Shouldn't happen unless the program is huge; fall back to sharing. */
+    return id < LSTATE_SIZE_MAX ? id : 1 + (id - 1) % (LSTATE_SIZE_MAX - 1);
+  };
+
+  auto bumpMap = [&](IRBuilder<> &IRB, Value *Idx) {
+    LoadInst *MapPtr = IRB.CreateLoad(Int8PtrTy, LSCovMapPtr);
+    MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Value *MapPtrIdx = IRB.CreateGEP(Int8Ty, MapPtr, Idx);
+    bumpCounter(M, IRB, MapPtrIdx);
+  };
+
+  /* Conditional branches: pick the index of the taken side with a select
+   * right before the branch, so no edge has to be split. */
+  for (BranchInst *BrI : branches) {
+    IRBuilder<> IRB(BrI);
+
+    ConstantInt *IdTrue = ConstantInt::get(Int32Ty, makeIdx(next_id++));
+    ConstantInt *IdFalse = ConstantInt::get(Int32Ty, makeIdx(next_id++));
+    Value *Idx = IRB.CreateSelect(BrI->getCondition(), IdTrue, IdFalse);
+
+    bumpMap(IRB, Idx);
+  }
+
+  /* Switches: probe each outgoing edge, splitting it if it's critical. Edges
+   * into EH pads can't be split and are left alone. */
+  for (auto &E : switch_edges) {
+    Instruction *TermI = E.first;
+    BasicBlock *Dest = TermI->getSuccessor(E.second);
+
+    BasicBlock *ProbeBB = SplitCriticalEdge(TermI, E.second);
+    if (!ProbeBB) {
+      if (Dest->isEHPad() || !Dest->getSinglePredecessor())
+        continue;
+      ProbeBB = Dest;
+    }
+
+    IRBuilder<> IRB(&(*ProbeBB->getFirstInsertionPt()));
+    bumpMap(IRB, ConstantInt::get(Int32Ty, makeIdx(next_id++)));
+  }
+
+  /* Export the exact map size, rounded up for the daemon. */
+  u32 map_size = (next_id + LSTATE_ALIGN - 1) & ~(LSTATE_ALIGN - 1);
+  if (map_size > LSTATE_SIZE_MAX) {
+    WARNF("%u probes don't fit in %u bytes, sharing entries.",
+        next_id - 1, LSTATE_SIZE_MAX);
+    map_size = LSTATE_SIZE_MAX;
+  }
+
+  exportMapSize(M, map_size);
+
+  if (pruned_funcs)
+    OKF("Pruned %u functions unreachable from main.", pruned_funcs);
+
+  return next_id - 1;
+}
+
+PreservedAnalyses LSCovPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  /* Show a banner */
+  //SAYF(cCYA "lscov-llvm-pass " cBRI VERSION cRST " by <iss300@gmail.com>\n");
+
+  insertMainHook(M);
+
+  int inst_locs = LTO ? instrumentBranches(M) : instrumentEdges(M);
+
   /* Say something nice */
-  if (!inst_blocks) WARNF("No instrumentation targets found.");
-  else OKF("Instrumented %u locations (lscov, ignoring SANCOV).", inst_blocks);
+  if (!inst_locs) WARNF("No instrumentation targets found.");
+  else if (LTO) OKF("Instrumented %u locations (lscov, LTO).", inst_locs);
+  else OKF("Instrumented %u locations (lscov, ignoring SANCOV).", inst_locs);
 
-  return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
 }
 
 extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK
@@ -130,5 +367,13 @@ llvmGetPassPluginInfo() {
         [](ModulePassManager &MPM, OptimizationLevel OL) {
           MPM.addPass(LSCovPass());
         });
+#if LLVM_VERSION_MAJOR >= 15
+      /* Only invoked by the LTO pipeline, i.e., when the plugin is loaded
+       * with '-Wl,--load-pass-plugin' instead of '-fpass-plugin'. */
+      PB.registerFullLinkTimeOptimizationLastEPCallback(
+        [](ModulePassManager &MPM, OptimizationLevel OL) {
+          MPM.addPass(LSCovPass(true));
+        });
+#endif
     }};
 }
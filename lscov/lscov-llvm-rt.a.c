@@ -7,74 +7,334 @@
  * See "llvm_mode/afl-llvm-rt.o.c" for the reference implementation.
  */
 
-#include <semaphore.h>
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
 #include <signal.h>
 #include <sys/types.h>
-#include <sys/shm.h>
+#include <unistd.h>
 #include "stuff.h"
+#include "channel.h"
+
+#ifdef LSCOV_THREADS
+#  include <dlfcn.h>
+#  include <pthread.h>
+#endif
 
 /* Constructor/destructor priority. Using some arbitrarily low priority. */
 
 #define CONST_PRIO 255 
 
-/* Globals for instrumentation */
+/* Globals for instrumentation. Thread-local only in the runtime for
+ * per-thread maps (libLSCovRT-threads.a, for binaries built with
+ * LSCOV_THREADS), since every probe pays for the TLS access. */
+
+#ifdef LSCOV_THREADS
+#  define LSCOV_TLS __thread
+#else
+#  define LSCOV_TLS
+#endif
+
+u8            __lscov_area_initial[LSTATE_SIZE_MAX];
+LSCOV_TLS u8* __lscov_area_ptr = __lscov_area_initial;
+LSCOV_TLS u32 __lscov_prev_loc;
+
+u32          __lscov_map_size = LSTATE_SIZE;
+
+/* Map sizes recorded by the instrumented modules (see the pass) */
+
+extern u32 __start___lscov_map_sz[] __attribute__((weak));
+extern u32 __stop___lscov_map_sz[] __attribute__((weak));
+
+struct lscov_chan_hdr*  __lscov_chan;
+struct lscov_chan_slot* __lscov_slot;   // Slot of this execution (if any)
+u32                     __lscov_num_threads;   // Maps handed out (per-thread)
+
+
+/* Claim a slot for this execution. In the blocking mode, wait until the
+ * daemon frees the (only) slot; otherwise, take any free one or none. */
 
-u8           __lscov_area_initial[LSTATE_SIZE];
-u8*          __lscov_area_ptr = __lscov_area_initial;
-__thread u32 __lscov_prev_loc;
+static struct lscov_chan_slot* __lscov_claim_slot(void) {
+  struct lscov_chan_hdr* hdr = __lscov_chan;
+  struct lscov_chan_slot* slot;
+  u32 state;
 
-sem_t*       __lscov_sema_rd;
-sem_t*       __lscov_sema_dr;
+  if (hdr->flags & LSCOV_CHAN_NONBLOCK) {
+    u32 num_slots = hdr->num_slots;
+    u32 start = __atomic_fetch_add(&hdr->slot_cursor, 1, __ATOMIC_RELAXED);
 
+    for (u32 i = 0; i < num_slots; i++) {
+      slot = lscov_chan_slot(hdr, (start + i) % num_slots);
+      state = LSCOV_SLOT_FREE;
+      if (__atomic_compare_exchange_n(&slot->state, &state, LSCOV_SLOT_BUSY,
+            0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return slot;
+    }
+
+    return NULL;
+  }
+
+  slot = lscov_chan_slot(hdr, 0);
+  while (1) {
+    state = LSCOV_SLOT_FREE;
+    if (__atomic_compare_exchange_n(&slot->state, &state, LSCOV_SLOT_BUSY,
+          0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return slot;
+
+    lscov_chan_wait(&slot->state, state, &hdr->rt_sleeping, &hdr->rt_spins,
+        NULL);
+  }
+}
 
 void __lscov_start_exec() {
-  /* Mark this hit count as unnotified yet to the daemon (0x01). */
-  *__lscov_area_ptr = 0x81;
+  struct lscov_chan_hdr* hdr = __lscov_chan;
+  u64 start_ns = hdr->flags & LSCOV_CHAN_TIMING ? lscov_now_ns() : 0;
+
+  /* Unless published, hit counts go to our private area. */
+  __lscov_area_ptr = __lscov_area_initial;
+
+  /* Deterministic 1-in-N sampling */
+  u64 tick = __atomic_fetch_add(&hdr->exec_tick, 1, __ATOMIC_RELAXED);
+  if (hdr->sample_rate > 1 && tick % hdr->sample_rate)
+    return;
+
+  struct lscov_chan_slot* slot = __lscov_claim_slot();
+  if (!slot) {
+    __atomic_fetch_add(&hdr->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
 
-  /* Wait until SHM is ready */
-  sem_wait(__lscov_sema_dr);
+  __lscov_area_ptr = lscov_chan_map(hdr, slot - lscov_chan_slot(hdr, 0));
+  __lscov_slot = slot;
+  __lscov_num_threads = 1;
 
   /* Clear area. */
-  memset(__lscov_area_ptr+1, 0, LSTATE_SIZE-1);
+  memset(__lscov_area_ptr, 0, __lscov_map_size);
+  __atomic_store_n(&slot->producer, getpid(), __ATOMIC_RELEASE);
+
+  if (start_ns)
+    lscov_hist_add_shared(&hdr->rt_wait, lscov_now_ns() - start_ns);
+}
+
+/* Hand the hit counts over to the daemon. Whoever moves the slot from busy to
+ * ready first (us, our signal handler, the next execution, or the daemon
+ * itself upon noticing that we died) finalizes the execution.
+ * Async-signal-safe. */
+
+static void __lscov_finish_exec(u32 status) {
+  struct lscov_chan_slot* slot = __lscov_slot;
+  if (!slot)
+    return;
+
+  /* Hits from here on (destructors, atexit handlers, a handler that
+   * recovered) stay out of the slot, which is about to be someone else's. */
+  __lscov_slot = NULL;
+  __lscov_area_ptr = __lscov_area_initial;
+  slot->num_threads = __lscov_num_threads;
+
+  u32 busy = LSCOV_SLOT_BUSY;
+  if (!__atomic_compare_exchange_n(&slot->state, &busy, 
+        LSCOV_SLOT_READY + status, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return;
+
+  lscov_chan_ring(&__lscov_chan->seq_done, &__lscov_chan->d_sleeping);
 }
 
 void __lscov_end_exec() {
-  /* Mark that it notified this termination to the daemon. */
-  *__lscov_area_ptr = 0x80;
-
-  int _sema_rd_val;
-  sem_getvalue(__lscov_sema_rd, &_sema_rd_val);
-  if (!_sema_rd_val) {
-    /* Mark the end of recording. */
-    sem_post(__lscov_sema_rd);
+  __lscov_finish_exec(LSCOV_EXEC_OK);
+}
+
+
+/* Threads (LSCOV_THREADS only). A new thread records to its parent's map,
+ * unless the daemon wants per-thread logic states; then it gets a fresh map
+ * next to the main thread's (as long as there's room). Interposing
+ * pthread_create() gets in the way of sanitizers' interceptors and of static
+ * linking, hence not by default. */
+
+#ifdef LSCOV_THREADS
+
+struct __lscov_thread_arg {
+  void* (*fn)(void*);
+  void* arg;
+  u8*   area;
+};
+
+static u8* __lscov_thread_area(void) {
+  struct lscov_chan_hdr* hdr = __lscov_chan;
+  struct lscov_chan_slot* slot = __lscov_slot;
+
+  if (!slot || !(hdr->flags & LSCOV_CHAN_THREADS))
+    return __lscov_area_ptr;
+
+  u32 max_threads = hdr->map_size_max / __lscov_map_size;
+  if (max_threads > LSCOV_THREADS_MAX)
+    max_threads = LSCOV_THREADS_MAX;
+
+  u32 tid = __atomic_fetch_add(&__lscov_num_threads, 1, __ATOMIC_RELAXED);
+  if (tid >= max_threads) {
+    __lscov_num_threads = max_threads;
+    return lscov_chan_map(hdr, slot - lscov_chan_slot(hdr, 0));
   }
+
+  u8* area = lscov_chan_map(hdr, slot - lscov_chan_slot(hdr, 0)) + 
+    (u64)tid * __lscov_map_size;
+  memset(area, 0, __lscov_map_size);
+  return area;
+}
+
+static void* __lscov_thread_start(void* _targ) {
+  struct __lscov_thread_arg targ = *(struct __lscov_thread_arg *)_targ;
+  free(_targ);
+
+  __lscov_area_ptr = targ.area;
+  return targ.fn(targ.arg);
 }
 
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+    void* (*fn)(void*), void* arg) {
+  static int (*real_pthread_create)(pthread_t*, const pthread_attr_t*,
+      void* (*)(void*), void*);
+
+  if (!real_pthread_create) {
+    real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+    if (!real_pthread_create)
+      FATAL("(lscov) cannot find pthread_create() (linked statically?)");
+  }
+
+  /* Not measuring: the new thread's area is the private one anyway. */
+  if (!__lscov_slot)
+    return real_pthread_create(thread, attr, fn, arg);
+
+  struct __lscov_thread_arg* targ = malloc(sizeof(struct __lscov_thread_arg));
+  if (!targ)
+    return real_pthread_create(thread, attr, fn, arg);
+
+  targ->fn = fn;
+  targ->arg = arg;
+  targ->area = __lscov_thread_area();
+
+  int ret = real_pthread_create(thread, attr, __lscov_thread_start, targ);
+  if (ret)
+    free(targ);
+
+  return ret;
+}
+
+#endif /* ^LSCOV_THREADS */
+
+
+/* Fatal signals: let whoever handled the signal before us (a sanitizer, a
+ * runtime that recovers from faults) take over, and only if it's the default
+ * action, finalize the execution as a crash before dying. A handler that
+ * doesn't return leaves the execution to the daemon, which notices us gone. */
+
+static const int __lscov_fatal_sigs[] = {
+  SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTRAP, SIGSYS
+};
+
+#define NUM_FATAL_SIGS (sizeof(__lscov_fatal_sigs) / sizeof(int))
+
+static struct sigaction __lscov_old_sa[NUM_FATAL_SIGS];
+static u8 __lscov_alt_stack[1 << 16];
+
+static void __lscov_fatal(int sig, siginfo_t* si, void* ctx) {
+  for (u32 i = 0; i < NUM_FATAL_SIGS; i++) {
+    if (__lscov_fatal_sigs[i] != sig)
+      continue;
+
+    struct sigaction* old = &__lscov_old_sa[i];
+    if (old->sa_flags & SA_SIGINFO) {
+      old->sa_sigaction(sig, si, ctx);
+      return;
+    } else if (old->sa_handler == SIG_IGN) {
+      /* Faults can't be ignored (they'd re-trigger); the kernel kills. */
+      if (sig == SIGSEGV || sig == SIGBUS || sig == SIGILL || sig == SIGFPE)
+        if (si->si_code > 0)
+          break;
+      return;
+    } else if (old->sa_handler != SIG_DFL) {
+      old->sa_handler(sig);
+      return;
+    }
+  }
+
+  __lscov_finish_exec(LSCOV_EXEC_CRASH);
+
+  /* Die the way we would have without us. Faults re-trigger upon return. */
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void __lscov_install_handlers(void) {
+  /* Stack overflows are crashes too, so handle them on a separate stack
+   * (unless somebody already set one up). */
+  stack_t ss;
+  if (!sigaltstack(NULL, &ss) && (ss.ss_flags & SS_DISABLE)) {
+    ss.ss_sp = __lscov_alt_stack;
+    ss.ss_size = sizeof(__lscov_alt_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_sigaction = __lscov_fatal;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  sigemptyset(&sa.sa_mask);
+
+  for (u32 i = 0; i < NUM_FATAL_SIGS; i++)
+    sigaction(__lscov_fatal_sigs[i], &sa, &__lscov_old_sa[i]);
+}
+
+
+/* The map size of this binary: the largest one among its modules. */
+
+static u32 __lscov_calc_map_size(void) {
+  u32 map_size = 0;
+
+  if (__start___lscov_map_sz)
+    for (u32 *sz = __start___lscov_map_sz; sz < __stop___lscov_map_sz; sz++)
+      if (*sz > map_size)
+        map_size = *sz;
+
+  if (!map_size)
+    map_size = LSTATE_SIZE;
+
+  return (map_size + LSTATE_ALIGN - 1) & ~(LSTATE_ALIGN - 1);
+}
 
 /* Initialization (upon starting) */
 
 __attribute__((constructor(CONST_PRIO))) 
 void __lscov_init(void) {
-  s32 shm_hcount_id = shmget(LSCOV_SHM_HCOUNT_KEY, LSTATE_SIZE, 0600);
-
-  if (shm_hcount_id >= 0) {
-    __lscov_area_ptr = (u8 *)shmat(shm_hcount_id, NULL, 0);
-    if (__lscov_area_ptr == (void *)-1) 
-      PFATAL("shmat() for hit_count failed");
-
-    /* Initialize semaphores. */
-    __lscov_sema_rd = sem_open(LSCOV_SEMA_RD_NAME, 0, 0644, 0);
-    if (__lscov_sema_rd == (void *)-1) 
-      PFATAL("sem_open() for sema_rd failed");
-
-    __lscov_sema_dr = sem_open(LSCOV_SEMA_DR_NAME, 0, 0644, 0);
-    if (__lscov_sema_dr == (void *)-1) 
-      PFATAL("sem_open() for sema_dr failed");
-
-    /* Signal the daemon to start an execution. For convenience's sake, just use
-     * one unlikely bit at the beginning. All logic states will have this bit,
-     * so it has zero implication for the coverage. */
-    *__lscov_area_ptr = 0x80;
+  __lscov_map_size = __lscov_calc_map_size();
+
+  struct lscov_chan_hdr *hdr = lscov_chan_attach();
+
+  if (hdr) {
+    /* Tell the daemon how much of the map we use. If it can't take it (or
+     * some other binary got there first), run without measurement. */
+    if (__lscov_map_size > hdr->map_size_max ||
+        (hdr->map_size && hdr->map_size != __lscov_map_size)) {
+      WARNF("(lscov) map size mismatch (binary: %u, daemon: %u/%u), "
+          "not measuring.", __lscov_map_size, hdr->map_size, 
+          hdr->map_size_max);
+      return;
+    }
+
+    __lscov_chan = hdr;
+
+    /* Telling the map size also tells the daemon that a fuzzer started. */
+    if (!hdr->map_size)
+      lscov_chan_post(&hdr->map_size, __lscov_map_size, &hdr->d_sleeping);
+
+    __lscov_install_handlers();
+
+#ifndef LSCOV_THREADS
+    if (hdr->flags & LSCOV_CHAN_THREADS)
+      WARNF("(lscov) not built with LSCOV_THREADS, threads share one map.");
+#endif
   }
 }
 
@@ -83,35 +343,35 @@ void __lscov_init(void) {
  * Some fuzzers (well, most of them) insert their initializer as a constuctor.
  * What's worse is that they put their initializer at the least priority,
  * so the forkserver happens before any other initializers. '__lscov_main'
- * CANNOT be one of them because it should wait a semaphore ('__lscov_sema_dr')
- * every execution. Just insert a call to '__lscov_main' at the beginning of
+ * CANNOT be one of them because it should wait for the daemon every
+ * execution. Just insert a call to '__lscov_main' at the beginning of
  * 'main' and that'll defeat all initializers. M-hwa-hwa-hwa. */
 
 void __lscov_main(void) {
   /* Similar to AFL, if we're running with logic state coverage measurement,
    * attach to the appropriate region. */
 
-  if (__lscov_sema_rd) {
-    /* If the destructor was not called in the last execution (e.g., due to a
-     * crash), mark it finished and let the daemon do its job. This hack will
-     * make the daemon ignore the very last execution if it was a crash, but
-     * it's just only *one* execution. */
-
-    if (*__lscov_area_ptr > 0x80) 
-      __lscov_end_exec();
+  if (__lscov_chan) {
+    /* If the last execution died silently (e.g., killed by the fuzzer's
+     * timeout) and the daemon hasn't noticed yet, finalize it ourselves. In
+     * the blocking mode, it's the one holding the slot we need. */
 
-    /* Sanity check: should be a lock-step. */
-    int _sema_dr_val;
-    sem_getvalue(__lscov_sema_dr, &_sema_dr_val);
-    if (_sema_dr_val > 1)
-      LSCOV_ABORT("(lscov) _sema_dr_val (=%d) > 1", _sema_dr_val);
+    struct lscov_chan_slot* slot = lscov_chan_slot(__lscov_chan, 0);
+    pid_t producer = slot->producer;
+    if (!(__lscov_chan->flags & LSCOV_CHAN_NONBLOCK) &&
+        slot->state == LSCOV_SLOT_BUSY && producer && 
+        lscov_pid_dead(producer)) {
+      __lscov_slot = slot;
+      __lscov_finish_exec(LSCOV_EXEC_HANG);
+    }
 
     __lscov_start_exec();
 
     /* Sanity check: should have a clear '__lscov_area_ptr'. */
     u8 _test_hc = 0;
-    for (int i = 1; i < (LSTATE_SIZE >> 6); i++)
-      _test_hc |= __lscov_area_ptr[i << 6];
+    if (__lscov_slot)
+      for (int i = 0; i < (__lscov_map_size >> 6); i++)
+        _test_hc |= __lscov_area_ptr[i << 6];
     if (_test_hc) 
       LSCOV_ABORT("(lscov) tainted hit counts");
   }
@@ -121,6 +381,6 @@ void __lscov_main(void) {
 
 __attribute__((destructor(CONST_PRIO))) 
 void __lscov_fin(void) {
-  if (__lscov_sema_rd) 
+  if (__lscov_chan) 
     __lscov_end_exec();
 }
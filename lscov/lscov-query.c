@@ -0,0 +1,375 @@
+/*
+ * lscov - event log queries
+ * -------------------------
+ *
+ * Answer questions about a measurement after the fact, from its event log
+ * (lscov.csv.ev, see evlog.h): coverage by executions or by time, at any
+ * step, and when coverage reached given counts. Logic states are counted
+ * exactly (by fingerprint), not estimated.
+ *
+ * The log is mapped and read a chunk of blocks at a time. Threads decode the
+ * blocks of a chunk in parallel, then each picks out the first occurrences
+ * among the fingerprints it owns (a share of the hash space), and the events
+ * are finally fed to the query in order.
+ */
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stuff.h"
+#include "evlog.h"
+
+#define CHUNK_BLOCKS    64          // Blocks decoded per round
+#define THREADS_MAX     64
+
+#define EVENT_FIRST     0x100       // First occurrence of the fingerprint
+
+/* Fingerprints seen (per thread): open addressing, grown at half full. A
+ * zero fingerprint is kept on the side, zero being the empty slot. */
+
+struct fp_set {
+  u64*        slots;
+  u64         size;               // Power of 2
+  u64         num;
+  u8          has_zero;
+};
+
+/* Queries */
+
+#define QUERY_EXECS     0   // Coverage every N executions
+#define QUERY_TIME      1   // Coverage every N seconds
+#define QUERY_REACH     2   // Time and executions to reach coverage counts
+#define QUERY_FIRST     3   // First sighting of a fingerprint
+
+#define REACH_MAX       64
+
+/* Parameters */
+
+u32         num_threads = 0;            // Threads (0: as many as CPUs)
+u8          query = QUERY_EXECS;
+u64         exec_step;                  // QUERY_EXECS
+u64         time_step_us;               // QUERY_TIME
+u64         reach[REACH_MAX];           // QUERY_REACH, ascending
+u32         num_reach;
+u64         first_fp;                   // QUERY_FIRST
+
+/* State variables */
+
+const u8*   log_base;             // Mapped event log
+u64         log_size;
+const struct lscov_evlog_hdr* log_hdr;
+u64         log_off;              // Next block to read
+
+const struct lscov_evblock_hdr* chunk[CHUNK_BLOCKS];
+struct lscov_event* chunk_events; // CHUNK_BLOCKS blocks' worth
+int         chunk_num_events[CHUNK_BLOCKS];
+u32         chunk_num_blocks;     // 0: no more blocks
+u8          chunk_bogus;
+
+pthread_barrier_t barrier;
+struct fp_set sets[THREADS_MAX];
+
+u64         cov;                  // Distinct fingerprints so far
+u64         num_events;
+u64         last_exec;
+u64         last_time_us;         // Since the log start
+u64         next_mark;            // Next execution count or time to report
+u32         next_reach;
+
+
+static void fp_set_grow(struct fp_set* s);
+
+static u8 fp_set_insert(struct fp_set* s, u64 fp) {
+  /* Returns 1 if 'fp' wasn't there. */
+  if (!fp) {
+    u8 is_new = !s->has_zero;
+    s->has_zero = 1;
+    return is_new;
+  }
+
+  u64 h = (fp ^ (fp >> 29)) & (s->size - 1);
+  while (s->slots[h]) {
+    if (s->slots[h] == fp)
+      return 0;
+    h = (h + 1) & (s->size - 1);
+  }
+
+  s->slots[h] = fp;
+  if (++s->num > s->size / 2)
+    fp_set_grow(s);
+  return 1;
+}
+
+static void fp_set_grow(struct fp_set* s) {
+  u64* old = s->slots;
+  u64 old_size = s->size;
+
+  s->size = old_size ? old_size << 1 : 1 << 16;
+  s->slots = calloc(s->size, sizeof(u64));
+  if (!s->slots)
+    PFATAL("fingerprint set allocation failed.");
+
+  s->num = 0;
+  for (u64 i = 0; i < old_size; i++)
+    if (old[i])
+      fp_set_insert(s, old[i]);
+  free(old);
+}
+
+static inline u32 fp_owner(u64 fp) {
+  return (u32)(fp >> 40) % num_threads;
+}
+
+
+static void query_report(u64 mark) {
+  /* A row at an execution count or a time (what's been asked for). */
+  if (query == QUERY_EXECS)
+    printf("%lu,%lu,%.3f\n", mark, cov, last_time_us / 1e6);
+  else
+    printf("%.3f,%lu,%lu\n", mark / 1e6, cov, last_exec);
+}
+
+void query_feed(const struct lscov_event* ev) {
+  /* Times don't go backwards within a block (or it's bogus), but a block
+   * may start before the last one ended in a log gone wrong. Don't let the
+   * marks run off. */
+  u64 time_us = num_events && ev->time_us < last_time_us ? 
+    last_time_us : ev->time_us;
+
+  /* Marks passed before this event see the coverage without it. */
+  switch (query) {
+  case QUERY_EXECS:
+    for (; ev->exec > next_mark; next_mark += exec_step)
+      query_report(next_mark);
+    break;
+  case QUERY_TIME:
+    for (; time_us > next_mark; next_mark += time_step_us)
+      query_report(next_mark);
+    break;
+  case QUERY_FIRST:
+    if (ev->fp == first_fp && ev->flags & EVENT_FIRST)
+      printf("%016lx,%.3f,%lu,%u,%s\n", ev->fp, time_us / 1e6, ev->exec,
+          ev->producer, ev->flags & LSCOV_EVENT_NEW ? "yes" : "no");
+    break;
+  }
+
+  num_events++;
+  last_exec = ev->exec;
+  last_time_us = time_us;
+  if (!(ev->flags & EVENT_FIRST))
+    return;
+
+  cov++;
+  for (; query == QUERY_REACH && next_reach < num_reach &&
+      cov >= reach[next_reach]; next_reach++)
+    printf("%lu,%.3f,%lu\n", reach[next_reach], time_us / 1e6, ev->exec);
+}
+
+void query_init(const char* name, const char* arg) {
+  if (!strcmp(name, "execs")) {
+    query = QUERY_EXECS;
+    exec_step = strtoull(arg, NULL, 0);
+    if (!exec_step)
+      FATAL("bad number of executions (1 or more)");
+    next_mark = exec_step;
+    printf("Execs,Coverage,Time\n");
+  } else if (!strcmp(name, "time")) {
+    query = QUERY_TIME;
+    time_step_us = atof(arg) * 1e6;
+    if (!time_step_us)
+      FATAL("bad period (a microsecond or more)");
+    next_mark = time_step_us;
+    printf("Time,Coverage,Execs\n");
+  } else if (!strcmp(name, "reach")) {
+    query = QUERY_REACH;
+    char* args = strdup(arg);
+    for (char* c = strtok(args, ","); c; c = strtok(NULL, ",")) {
+      if (num_reach == REACH_MAX)
+        FATAL("too many coverage counts (max: %u)", REACH_MAX);
+      reach[num_reach] = strtoull(c, NULL, 0);
+      if (num_reach && reach[num_reach] <= reach[num_reach - 1])
+        FATAL("coverage counts must go up");
+      num_reach++;
+    }
+    free(args);
+    printf("Coverage,Time,Execs\n");
+  } else if (!strcmp(name, "first")) {
+    query = QUERY_FIRST;
+    first_fp = strtoull(arg, NULL, 16);
+    printf("Fingerprint,Time,Execs,Producer,New\n");
+  } else {
+    FATAL("bad query '%s' (execs, time, reach, or first)", name);
+  }
+}
+
+void query_end() {
+  /* Where it all ended up (the last mark, if it's right there). */
+  if (num_events && query == QUERY_EXECS)
+    query_report(last_exec);
+  else if (num_events && query == QUERY_TIME)
+    query_report(last_time_us);
+
+  fprintf(stderr, "%lu event(s), %lu execution(s), %lu logic state(s)\n",
+      num_events, last_exec, cov);
+}
+
+
+void log_map(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    PFATAL("cannot open '%s'", path);
+
+  struct stat st;
+  if (fstat(fd, &st))
+    PFATAL("fstat() failed");
+  if (st.st_size < (off_t)sizeof(struct lscov_evlog_hdr))
+    FATAL("'%s' is too short for an event log", path);
+
+  log_base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (log_base == MAP_FAILED)
+    PFATAL("mmap() failed");
+  close(fd);
+
+  /* Read front to back, once. */
+  madvise((void *)log_base, st.st_size, MADV_SEQUENTIAL);
+
+  log_size = st.st_size;
+  log_hdr = (const struct lscov_evlog_hdr *)log_base;
+
+  if (memcmp(log_hdr->magic, LSCOV_EVLOG_MAGIC, sizeof(log_hdr->magic)))
+    FATAL("'%s' is not an event log", path);
+  if (log_hdr->version != LSCOV_EVLOG_VERSION)
+    FATAL("event log version mismatch (file: %u, us: %u)", log_hdr->version,
+        LSCOV_EVLOG_VERSION);
+  if (log_hdr->hdr_size < sizeof(struct lscov_evlog_hdr) ||
+      log_hdr->hdr_size > log_size)
+    FATAL("'%s' has a bogus header", path);
+
+  log_off = log_hdr->hdr_size;
+}
+
+static void chunk_next() {
+  /* Only the block headers; a trailing partial block is being written. */
+  chunk_num_blocks = 0;
+
+  while (chunk_num_blocks < CHUNK_BLOCKS &&
+      log_off + sizeof(struct lscov_evblock_hdr) <= log_size) {
+    const struct lscov_evblock_hdr* b =
+      (const struct lscov_evblock_hdr *)(log_base + log_off);
+    if (log_off + sizeof(*b) + b->size > log_size)
+      break;
+
+    chunk[chunk_num_blocks++] = b;
+    log_off += sizeof(*b) + b->size;
+  }
+}
+
+static void* chunk_work(void* _tid) {
+  u32 tid = (u32)(intptr_t)_tid;
+
+  while (1) {
+    /* Thread 0 lines up the blocks... */
+    if (!tid)
+      chunk_next();
+    pthread_barrier_wait(&barrier);
+    if (!chunk_num_blocks)
+      break;
+
+    /* ... everyone decodes some ... */
+    for (u32 i = tid; i < chunk_num_blocks; i += num_threads) {
+      chunk_num_events[i] = lscov_evblock_decode(chunk[i],
+          chunk_events + (u64)i * LSCOV_EVBLOCK_EVENTS);
+      if (chunk_num_events[i] < 0)
+        chunk_bogus = 1;
+    }
+    pthread_barrier_wait(&barrier);
+    if (chunk_bogus)
+      break;
+
+    /* ... and looks for the first occurrences of its own fingerprints. */
+    for (u32 i = 0; i < chunk_num_blocks; i++) {
+      struct lscov_event* ev = chunk_events + (u64)i * LSCOV_EVBLOCK_EVENTS;
+      for (int j = 0; j < chunk_num_events[i]; j++)
+        if (fp_owner(ev[j].fp) == tid && fp_set_insert(&sets[tid], ev[j].fp))
+          ev[j].flags |= EVENT_FIRST;
+    }
+    pthread_barrier_wait(&barrier);
+
+    /* Thread 0 then hands them over in order. */
+    if (!tid) {
+      for (u32 i = 0; i < chunk_num_blocks; i++) {
+        struct lscov_event* ev = chunk_events + (u64)i * LSCOV_EVBLOCK_EVENTS;
+        for (int j = 0; j < chunk_num_events[i]; j++)
+          query_feed(&ev[j]);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+int main(int argc, char** argv) {
+  int c;
+  while ((c = getopt(argc, argv, "+j:")) != -1) {
+    switch (c) {
+    case 'j':
+      num_threads = atoi(optarg);
+      if (!num_threads || num_threads > THREADS_MAX)
+        FATAL("bad number of threads (1 to %u)", THREADS_MAX);
+      break;
+    default:
+      exit(1);
+    }
+  }
+
+  if (argc - optind < 3) {
+    SAYF("Usage: %s [-j threads] <event log> <query> <arg>\n\n"
+         "    execs <N>          coverage every N executions\n"
+         "    time <sec>         coverage every so many seconds\n"
+         "    reach <C>[,<C>..]  time and executions to reach coverage C\n"
+         "    first <fp>         when a fingerprint (in hex) was first seen\n",
+         argv[0]);
+    exit(1);
+  }
+
+  if (!num_threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cpus < 1 ? 1 : cpus > THREADS_MAX ? THREADS_MAX : cpus;
+  }
+
+  log_map(argv[optind]);
+  query_init(argv[optind + 1], argv[optind + 2]);
+
+  chunk_events = malloc((u64)CHUNK_BLOCKS * LSCOV_EVBLOCK_EVENTS *
+      sizeof(struct lscov_event));
+  if (!chunk_events)
+    PFATAL("event buffer allocation failed.");
+  for (u32 t = 0; t < num_threads; t++)
+    fp_set_grow(&sets[t]);
+
+  pthread_barrier_init(&barrier, NULL, num_threads);
+
+  pthread_t threads[THREADS_MAX];
+  for (u32 t = 1; t < num_threads; t++)
+    if (pthread_create(&threads[t], NULL, chunk_work, (void *)(intptr_t)t))
+      PFATAL("pthread_create() failed");
+  chunk_work(0);
+  for (u32 t = 1; t < num_threads; t++)
+    pthread_join(threads[t], NULL);
+
+  if (chunk_bogus)
+    FATAL("'%s' has a bogus block", argv[optind]);
+
+  query_end();
+  return 0;
+}
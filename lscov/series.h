@@ -0,0 +1,135 @@
+/*
+ * lscov - time series
+ * -------------------
+ *
+ * Binary twin of lscov.csv: a header naming the columns, followed by records
+ * of 8 bytes per column, appended as they're tallied. Readers can mmap() it
+ * and index records right away. A trailing partial record is being written.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stuff.h"
+
+#define LSCOV_SERIES_MAGIC      "LSCOVTS"
+#define LSCOV_SERIES_VERSION    1
+#define LSCOV_SERIES_FIELDS_MAX 64
+
+/* Column types, and how many decimal places to print. */
+
+#define LSCOV_SERIES_U64        0
+#define LSCOV_SERIES_F64        1
+
+#define LSCOV_SERIES_AUTO       0xff    // As in %g
+
+struct lscov_series_field {
+  char        name[48];           // As in the CSV header
+  u32         type;               // LSCOV_SERIES_U64 or _F64
+  u32         digits;             // Decimal places (F64)
+};
+
+struct lscov_series_hdr {
+  char        magic[8];           // LSCOV_SERIES_MAGIC
+  u32         version;            // LSCOV_SERIES_VERSION
+  u32         hdr_size;           // Records start here (64-byte aligned)
+  u32         num_fields;
+  u32         record_size;        // 8 bytes per field
+  u64         reserved;
+  struct lscov_series_field fields[];
+};
+
+union lscov_series_value {
+  u64         u;
+  double      f;
+};
+
+static inline u32 lscov_series_hdr_size(u32 num_fields) {
+  u32 size = sizeof(struct lscov_series_hdr) +
+    num_fields * sizeof(struct lscov_series_field);
+  return (size + 63) & ~63;
+}
+
+static inline u64 lscov_series_num_records(const struct lscov_series_hdr* hdr,
+    u64 file_size) {
+  if (file_size < hdr->hdr_size)
+    return 0;
+
+  return (file_size - hdr->hdr_size) / hdr->record_size;
+}
+
+static inline const union lscov_series_value* lscov_series_record(
+    const struct lscov_series_hdr* hdr, u64 i) {
+  return (const union lscov_series_value *)
+    ((const u8 *)hdr + hdr->hdr_size + i * hdr->record_size);
+}
+
+/* The CSV way of writing a value. */
+
+static inline void lscov_series_print(FILE* f,
+    const struct lscov_series_field* field, union lscov_series_value v) {
+  if (field->type == LSCOV_SERIES_U64)
+    fprintf(f, "%lu", v.u);
+  else if (field->digits == LSCOV_SERIES_AUTO)
+    fprintf(f, "%g", v.f);
+  else
+    fprintf(f, "%3.*f", field->digits, v.f);
+}
+
+static inline void lscov_series_print_header(FILE* f,
+    const struct lscov_series_field* fields, u32 num_fields) {
+  for (u32 i = 0; i < num_fields; i++)
+    fprintf(f, i ? ",%s" : "%s", fields[i].name);
+  fprintf(f, "\n");
+}
+
+static inline void lscov_series_print_record(FILE* f,
+    const struct lscov_series_field* fields, u32 num_fields,
+    const union lscov_series_value* rec) {
+  for (u32 i = 0; i < num_fields; i++) {
+    if (i)
+      fputc(',', f);
+    lscov_series_print(f, &fields[i], rec[i]);
+  }
+  fprintf(f, "\n");
+}
+
+/* Map a series (read-only) and check that we can read it. */
+
+static inline const struct lscov_series_hdr* lscov_series_map(
+    const char* path, u64* file_size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    PFATAL("cannot open '%s'", path);
+
+  struct stat st;
+  if (fstat(fd, &st))
+    PFATAL("fstat() failed");
+  if (st.st_size < (off_t)sizeof(struct lscov_series_hdr))
+    FATAL("'%s' is too short for a time series", path);
+
+  const struct lscov_series_hdr* hdr = mmap(0, st.st_size, PROT_READ,
+      MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED)
+    PFATAL("mmap() failed");
+  close(fd);
+
+  if (memcmp(hdr->magic, LSCOV_SERIES_MAGIC, sizeof(hdr->magic)))
+    FATAL("'%s' is not a time series", path);
+  if (hdr->version != LSCOV_SERIES_VERSION)
+    FATAL("time series version mismatch (file: %u, us: %u)", hdr->version,
+        LSCOV_SERIES_VERSION);
+  if (hdr->num_fields > LSCOV_SERIES_FIELDS_MAX ||
+      hdr->record_size != hdr->num_fields * 8 ||
+      hdr->hdr_size != lscov_series_hdr_size(hdr->num_fields) ||
+      st.st_size < hdr->hdr_size)
+    FATAL("'%s' has a bogus header", path);
+
+  *file_size = st.st_size;
+  return hdr;
+}
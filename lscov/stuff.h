@@ -39,11 +39,25 @@ typedef int64_t  s64;
 #define MEM_BARRIER() \
   __asm__ volatile("" ::: "memory")
 
-/* Logic state size: simply following MAP_SIZE in AFL. */
+/* Logic state size: simply following MAP_SIZE in AFL. This is only the
+ * default; a binary may use less (LTO mode) or more (LSCOV_MAP_SIZE_POW2 at
+ * compile time), up to LSTATE_SIZE_MAX. */
 
 #define LSTATE_SIZE_POW2 16
 #define LSTATE_SIZE      (1 << LSTATE_SIZE_POW2)
 
+#define LSTATE_SIZE_MAX_POW2 23
+#define LSTATE_SIZE_MAX      (1 << LSTATE_SIZE_MAX_POW2)
+
+/* Logic state sizes are always a multiple of this (for 64-bit loops). */
+
+#define LSTATE_ALIGN 64
+
+/* Section where each instrumented module records the map size it needs. The
+ * runtime takes the largest one. */
+
+#define LSCOV_MAP_SIZE_SECTION "__lscov_map_sz"
+
 /*******************
  * Terminal colors *
  *******************/
@@ -268,18 +282,7 @@ typedef int64_t  s64;
 
 #define RANDOM(x) (random() % (x))
 
-/* SHM parameters */
-
-#define LSCOV_SHM_HCOUNT_KEY  0xdead
-#define LSCOV_SEMA_RD_NAME    "__lscov_sema_rd" 
-#define LSCOV_SEMA_DR_NAME    "__lscov_sema_dr"
-
 /* Likeliness */
 
 #define unlikely(_x)  __builtin_expect(!!(_x), 0)
 #define likely(_x)  __builtin_expect(!!(_x), 1)
-
-/* Use buckets? */
-
-//#define LSCOV_BUCKET
-#define BUCKET_1
@@ -167,6 +167,8 @@ typedef struct aflcc_state {
 
   u8 cmplog_mode;
 
+  u8 lscov_mode;
+
   u8 have_instr_env, have_gcc, have_clang, have_llvm, have_gcc_plugin, have_lto,
       have_optimized_pcguard, have_instr_list;
 
@@ -296,6 +298,7 @@ param_st parse_linking_params(aflcc_state_t *, u8 *, u8, u8 *skip_next,
 
 void add_lto_linker(aflcc_state_t *);
 void add_lto_passes(aflcc_state_t *);
+void add_lscov_pass(aflcc_state_t *);
 void add_runtime(aflcc_state_t *);
 
 /** Global declarations -----END----- **/
@@ -1367,6 +1370,20 @@ void mode_final_checkout(aflcc_state_t *aflcc, int argc, char **argv) {
   aflcc->cmplog_mode = getenv("AFL_CMPLOG") || getenv("AFL_LLVM_CMPLOG") ||
                        getenv("AFL_GCC_CMPLOG");
 
+  aflcc->lscov_mode = !!getenv("AFL_LLVM_LSCOV");
+
+  if (aflcc->lscov_mode && aflcc->compiler_mode != LLVM &&
+      aflcc->compiler_mode != LTO)
+    FATAL(
+        "AFL_LLVM_LSCOV is only supported with afl-clang-fast/afl-clang-lto, "
+        "not with %s",
+        compiler_mode_2str(aflcc->compiler_mode));
+
+#if LLVM_MAJOR < 15
+  if (aflcc->lscov_mode && aflcc->compiler_mode == LTO)
+    FATAL("AFL_LLVM_LSCOV with afl-clang-lto requires LLVM 15+");
+#endif
+
 }
 
 /*
@@ -1379,11 +1396,12 @@ void mode_notification(aflcc_state_t *aflcc) {
   char *ptr3 = alloc_printf(" + K-CTX-%u", aflcc->ctx_k);
 
   char *ptr1 = alloc_printf(
-      "%s%s%s%s%s", instrument_mode_2str(aflcc->instrument_mode),
+      "%s%s%s%s%s%s", instrument_mode_2str(aflcc->instrument_mode),
       (aflcc->instrument_opt_mode & INSTRUMENT_OPT_CTX) ? " + CTX" : "",
       (aflcc->instrument_opt_mode & INSTRUMENT_OPT_CALLER) ? " + CALLER" : "",
       (aflcc->instrument_opt_mode & INSTRUMENT_OPT_NGRAM) ? ptr2 : "",
-      (aflcc->instrument_opt_mode & INSTRUMENT_OPT_CTX_K) ? ptr3 : "");
+      (aflcc->instrument_opt_mode & INSTRUMENT_OPT_CTX_K) ? ptr3 : "",
+      aflcc->lscov_mode ? " + LSCOV" : "");
 
   ck_free(ptr2);
   ck_free(ptr3);
@@ -2315,6 +2333,65 @@ void add_lto_passes(aflcc_state_t *aflcc) {
 
 }
 
+/*
+  Find an object built by lscov. $AFL_LSCOV_PATH (usually lscov/build) is
+  checked first, then the usual find_object() locations. Returns NULL if the
+  object can't be found.
+*/
+static u8 *find_lscov_object(aflcc_state_t *aflcc, u8 *obj) {
+
+  u8 *lscov_path = getenv("AFL_LSCOV_PATH");
+
+  if (lscov_path) {
+
+    u8 *tmp = alloc_printf("%s/%s", lscov_path, obj);
+
+    if (aflcc->debug) DEBUGF("Trying %s\n", tmp);
+
+    if (!access(tmp, R_OK)) { return tmp; }
+
+    ck_free(tmp);
+
+  }
+
+  return find_object(aflcc, obj);
+
+}
+
+/*
+  Add params to run the lscov logic state pass in the same pipeline as our
+  own instrumentation, so one compile yields both maps. The pass registers
+  at the same extension point as SanitizerCoveragePCGUARD.so and is loaded
+  after it; pcguard only adds blocks that end in an unconditional branch,
+  which lscov skips, so no probe is emitted twice. In LTO mode, the pass is
+  handed to the linker instead and runs next to SanitizerCoverageLTO.so on
+  the whole program.
+*/
+void add_lscov_pass(aflcc_state_t *aflcc) {
+
+  u8 *pass = find_lscov_object(aflcc, "libLSCovPass.so");
+  if (!pass)
+    FATAL(
+        "Unable to find 'libLSCovPass.so', build lscov and set "
+        "AFL_LSCOV_PATH to its build directory");
+
+  if (aflcc->lto_mode) {
+
+    insert_param(aflcc, alloc_printf("-Wl,--load-pass-plugin=%s", pass));
+
+  } else {
+
+#if LLVM_MAJOR < 16
+    insert_param(aflcc, "-fexperimental-new-pass-manager");
+#endif
+    insert_param(aflcc, alloc_printf("-fpass-plugin=%s", pass));
+
+  }
+
+  ck_free(pass);
+
+}
+
 /* Add params to link with libAFLDriver.a on request */
 static void add_aflpplib(aflcc_state_t *aflcc) {
 
@@ -2439,6 +2516,24 @@ void add_runtime(aflcc_state_t *aflcc) {
 
 #endif
 
+  if (aflcc->lscov_mode && !aflcc->shared_linking &&
+      !aflcc->partial_linking) {
+
+    u8 *lscov_rt_name =
+        getenv("LSCOV_THREADS") ? "libLSCovRT-threads.a" : "libLSCovRT.a";
+    u8 *lscov_rt = find_lscov_object(aflcc, lscov_rt_name);
+    if (!lscov_rt)
+      FATAL(
+          "Unable to find '%s', build lscov and set "
+          "AFL_LSCOV_PATH to its build directory",
+          lscov_rt_name);
+
+    insert_param(aflcc, lscov_rt);
+    insert_param(aflcc, "-lpthread");
+    insert_param(aflcc, "-ldl");
+
+  }
+
   add_aflpplib(aflcc);
 
 #if defined(USEMMAP) && !defined(__HAIKU__) && !__APPLE__
@@ -2887,7 +2982,9 @@ static void maybe_usage(aflcc_state_t *aflcc, int argc, char **argv) {
             "functions\n"
             "  AFL_LLVM_ALLOWLIST/AFL_LLVM_DENYLIST: enable "
             "instrument allow/\n"
-            "    deny listing (selective instrumentation)\n");
+            "    deny listing (selective instrumentation)\n"
+            "  AFL_LLVM_LSCOV: also add lscov logic state instrumentation\n"
+            "  AFL_LSCOV_PATH: path to the lscov build directory\n");
 
       if (aflcc->have_llvm)
         SAYF(
@@ -3362,6 +3459,7 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
 
         add_lto_linker(aflcc);
         add_lto_passes(aflcc);
+        if (aflcc->lscov_mode) { add_lscov_pass(aflcc); }
 
       }
 
@@ -3381,6 +3479,8 @@ static void edit_params(aflcc_state_t *aflcc, u32 argc, char **argv,
 
       }
 
+      if (aflcc->lscov_mode) { add_lscov_pass(aflcc); }
+
     }
 
     if (aflcc->cmplog_mode) {